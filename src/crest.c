@@ -1,88 +1,94 @@
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <poll.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <errno.h>
+#include <signal.h>
 #include "crest.h"
 
 #define MAX_LINE_LENGTH   10 * 1024
-#define MAX_BUFFER_READ   10 * 1024
 #define MIN_BUFFER_READ   128
 
+const char *crest_method_names[CREST_METHODS_COUNT] = {
+  "GET", "POST", "PUT", "PATCH", "DELETE", "HEAD", "OPTIONS"
+};
+
+// accepted connections whose request head hasn't been read yet.
+// their sockets are nonblocking and polled by the I/O thread, so
+// an idle or slow client never holds up other connections or
+// HTTP/2 sessions
+static crest_connection *pending[CREST_MAX_PENDING_CONNECTIONS];
+static int pending_count = 0;
+
 /*------------------------------------------------------------*/
 /* private socket functions                                   */
 /*------------------------------------------------------------*/
 int crest_read_more(crest_connection *connection) {
-  // MAX_BUFFER_READ effectively acts as a high water mark, and
-  // MIN_BUFFER_READ as a low water mark - when there is less
-  // than MIN_BUFFER_READ bytes free in the buffer, the buffer
-  // is increased by MAX_BUFFER_READ bytes. The loop will
-  // attempt to read the number of free bytes available,
-  // bounding reads to be between MIN_BUFFER_READ and
-  // MAX_BUFFER_READ bytes.
-  
-  int free_bytes = connection->request_buffer_length - connection->request_data_length;
-  if(free_bytes < MIN_BUFFER_READ) {
+  // MIN_BUFFER_READ acts as a low water mark - when there is less
+  // than MIN_BUFFER_READ bytes free in the buffer, the buffer is
+  // doubled in size, up to the most a request head may need. the
+  // read then attempts to fill all of the free space. one byte is
+  // always kept free so the data read so far, and so the body, is
+  // NUL terminated.
+  
+  int free_bytes = connection->request_buffer_length - connection->request_data_length - 1;
+  if((free_bytes < MIN_BUFFER_READ) && (connection->request_buffer_length <= CREST_MAX_REQUEST_HEAD_LENGTH)) {
     // TODO: handle realloc failure
-    connection->request_buffer_length += MAX_BUFFER_READ;
+    char *old_buffer = connection->request_buffer;
+    int new_length = connection->request_buffer_length * 2;
+    if(new_length > CREST_MAX_REQUEST_HEAD_LENGTH + 1)
+      new_length = CREST_MAX_REQUEST_HEAD_LENGTH + 1;
+    free_bytes += new_length - connection->request_buffer_length;
+    connection->request_buffer_length = new_length;
     connection->request_buffer = (char *) realloc(connection->request_buffer, connection->request_buffer_length);
-    free_bytes += MAX_BUFFER_READ;
+    
+    // line_start and line_end point into the buffer, and need
+    // to be moved along with it
+    connection->line_start = connection->request_buffer + (connection->line_start - old_buffer);
+    connection->line_end = connection->request_buffer + (connection->line_end - old_buffer);
   }
   
-  // TODO: handle EOF
   int bytes_read = read(connection->client, connection->request_buffer + connection->request_data_length, free_bytes);
-  if(bytes_read == -1)
+  if((bytes_read == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+    return CREST_READ_MORE;
+  
+  // EOF before a complete request head is treated as a read error
+  if(bytes_read <= 0)
     return CREST_READ_ERROR;
+  if(connection->request_data_length == 0)
+    crest_trace(connection, crest_phase_first_byte);
   connection->request_data_length += bytes_read;
+  connection->request_buffer[connection->request_data_length] = 0;
   return CREST_READ_OK;
 }
 
+// find the CRLF terminated line starting at line_start in the
+// data read so far. returns CREST_READ_MORE if the line hasn't
+// been completely read yet
 int crest_read_line(crest_connection *connection) {
-  int line_length = 0, read_necessary = 1;
-  char *buffer_end;
-  
-  // setup an initial buffer if one doesn't exist
-  if(!connection->request_buffer) {
-    // TODO: handle malloc error
-    connection->request_buffer = (char *) malloc(MAX_LINE_LENGTH);
-    connection->request_buffer_length = MAX_LINE_LENGTH;
-    connection->line_start = connection->request_buffer;
-    connection->line_end = connection->request_buffer;
-  }
-  
-  // move line_start to the next line if at least one
-  // line has been read previously
-  if(*connection->line_end == '\n')
-    connection->line_start = connection->line_end + 1;
+  char *buffer_end = connection->request_buffer + connection->request_data_length;
   
-  // an initial read isn't necessary if there are at least 2
-  // bytes remaining in the buffer (to match CRLF)
-  if(((connection->request_buffer + connection->request_data_length) - connection->line_start) >= 2)
-    read_necessary = 0;
+  // move line_end up until end of data or LF
+  connection->line_end = connection->line_start;
+  while((connection->line_end != buffer_end) && (*connection->line_end != LF))
+    connection->line_end++;
   
-  while(line_length < MAX_LINE_LENGTH) {
-    if(read_necessary)
-      crest_read_more(connection);
-    read_necessary = 1;
-    
-    // move line_end up until end of string or LF
-    connection->line_end = connection->line_start;
-    buffer_end = connection->request_buffer + connection->request_data_length;
-    while((connection->line_end != buffer_end) && (*connection->line_end != LF))
-      connection->line_end++;
-    
-    // ensure there are at least 2 characters in the line, and
-    // try to match a CRLF pair
-    if(*connection->line_end == LF && (connection->line_end != connection->line_start) && (*(connection->line_end - 1) == CR))
-      return CREST_READ_OK;
-    line_length = connection->line_end - connection->line_start;
-  }
+  if(connection->line_end == buffer_end)
+    return CREST_READ_MORE;
   
+  // ensure there are at least 2 characters in the line, and
+  // try to match a CRLF pair
+  if((connection->line_end != connection->line_start) && (*(connection->line_end - 1) == CR))
+    return CREST_READ_OK;
   return CREST_READ_ERROR;
 }
 
@@ -93,21 +99,25 @@ int crest_read_line(crest_connection *connection) {
 // parse request line: method SP URI SP HTTP/major.minor CRLF
 int crest_parse_request_line(crest_connection *connection) {
 	char *start, *end, *ptr = connection->line_start;
+  unsigned char *method = (unsigned char *) ptr;
   assert(connection);
 	
-  switch(((uint32_t *)ptr)[0]) {
+  // multi-character constants are laid out most significant
+  // byte first, so build the method name the same way rather
+  // than casting ptr, which only matches on big endian hosts
+  switch((method[0] << 24) | (method[1] << 16) | (method[2] << 8) | method[3]) {
     case 'GET ':
       connection->method = http_get;
       ptr += 3;
       break;
     
     case 'POST':
-      connection->method = http_get;
+      connection->method = http_post;
       ptr += 4;
       break;
     
     case 'PUT ':
-      connection->method = http_post;
+      connection->method = http_put;
       ptr += 3;
       break;
     
@@ -155,7 +165,7 @@ int crest_parse_request_line(crest_connection *connection) {
 
 	// match 'HTTP/'
 	if(ptr[0] == 'H' && ptr[4] == '/')
-		start += HTTP_VERSION_PREFIX_LEN;
+		ptr += HTTP_VERSION_PREFIX_LEN;
 	else
 		return CREST_PARSE_ERROR;
 	
@@ -198,8 +208,14 @@ int crest_parse_header_line(crest_connection *connection) {
   if(*ptr != ':')
     return CREST_PARSE_ERROR;
   *ptr = 0;
+  ptr++;
   move_to_end_of_ws(ptr);
   
+  if(connection->request_headers_count >= CREST_MAX_REQUEST_HEADERS) {
+    connection->response_status = 431;
+    return CREST_PARSE_ERROR;
+  }
+  
   // make space for a new header
   int new_headers_count = ++connection->request_headers_count;
   connection->request_header_keys = realloc(connection->request_header_keys, new_headers_count * sizeof(char *));
@@ -207,7 +223,7 @@ int crest_parse_header_line(crest_connection *connection) {
   
   // null terminate the header value after the last non WS char
   char *value = ptr;
-  ptr = connection->line_end;
+  ptr = connection->line_end - 1;
   
   while((ptr >= value) && ((*ptr == '\r') || (*ptr == '\n') || (*ptr == ' ') || (*ptr == '\t'))) {
     *ptr = 0;
@@ -218,29 +234,305 @@ int crest_parse_header_line(crest_connection *connection) {
   // ptrs to strings within request_buffer, as request_buffer
   // may move during realloc
   connection->request_header_keys[new_headers_count - 1] = strdup(connection->line_start);
-  connection->request_header_values[new_headers_count - 1] = strdup(ptr);
+  connection->request_header_values[new_headers_count - 1] = strdup(value);
   
   return CREST_PARSE_OK;
 }
 
 
+/*------------------------------------------------------------*/
+/* private connection functions                               */
+/*------------------------------------------------------------*/
+const char *crest_status_reason(int status) {
+  switch(status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 414: return "URI Too Long";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default:  return "Unknown";
+  }
+}
+
+// writev until every part has been written, or an error occurs
+void crest_write_all(int fd, struct iovec *parts, int count) {
+  while(count > 0) {
+    ssize_t written = writev(fd, parts, count);
+    if(written == -1) {
+      if(errno == EINTR)
+        continue;
+      return;
+    }
+    
+    while((count > 0) && (written >= parts->iov_len)) {
+      written -= parts->iov_len;
+      parts++;
+      count--;
+    }
+    
+    if(count > 0) {
+      parts->iov_base = (char *) parts->iov_base + written;
+      parts->iov_len -= written;
+    }
+  }
+}
+
+// threads inherit the creating thread's signal mask. SIGHUP,
+// SIGTERM and SIGINT are blocked in every thread started by the
+// server, so they're always delivered to the I/O thread, where
+// they interrupt poll
+int crest_start_thread(pthread_t *thread, void *(*start)(void *), void *argument) {
+  sigset_t signals, old_signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+  int error = pthread_create(thread, NULL, start, argument);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  return error;
+}
+
+void crest_free_connection(crest_connection *connection) {
+  if(connection->request_headers_count > 0) {
+    for(int i = 0; i < connection->request_headers_count; i++) {
+      free(connection->request_header_keys[i]);
+      free(connection->request_header_values[i]);
+    }
+    free(connection->request_header_keys);
+    free(connection->request_header_values);
+  }
+
+  if(connection->response_headers_count > 0) {
+    for(int i = 0; i < connection->response_headers_count; i++) {
+      free(connection->response_header_keys[i]);
+      free(connection->response_header_values[i]);
+    }
+    free(connection->response_header_keys);
+    free(connection->response_header_values);
+  }
+
+  if(connection->uri)
+    free(connection->uri);
+
+  if(connection->remote_address)
+    free(connection->remote_address);
+
+  if(connection->request_buffer)
+    free(connection->request_buffer);
+
+  if(connection->response_body)
+    free(connection->response_body);
+  
+  crest_routes_release(connection);
+  if(connection->client != -1)
+    close(connection->client);
+  free(connection);
+}
+
+// HTTP/2 streams queue their response on the stream's session,
+// and are freed once the response has been sent
+void crest_finish(crest_connection *connection) {
+  if(connection->stream)
+    crest_h2_respond(connection);
+  else
+    crest_complete(connection);
+  crest_log_request(connection);
+#ifdef CREST_TRACE
+  crest_trace_commit(connection);
+#endif
+  if(connection->stream)
+    crest_h2_release(connection);
+  else
+    crest_free_connection(connection);
+}
+
+// responses are written with blocking writes. the send timeout
+// bounds how long a client that stops reading can hold up the I/O
+// thread, as a write that makes no progress for
+// CREST_WRITE_TIMEOUT ms fails and the response is abandoned
+void crest_set_blocking(int fd) {
+  struct timeval timeout = {CREST_WRITE_TIMEOUT / 1000, (CREST_WRITE_TIMEOUT % 1000) * 1000};
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// read whatever the client has sent, and parse as much of the
+// request head as possible. returns CREST_READ_MORE while the head
+// is incomplete, otherwise the connection has been routed, taken
+// over by an HTTP/2 session, or freed. handlers for @offload routes
+// are run on the offload pool, and the connection is finished by
+// crest_handle_completed once the handler has returned
+int crest_read_request(crest_connection *connection) {
+  int status = crest_read_more(connection);
+  if(status == CREST_READ_ERROR)
+    crest_free_connection(connection);
+  if(status != CREST_READ_OK)
+    return status;
+  
+  // headers continue until the blank line preceding the body.
+  // lines and whole heads over their limits are answered rather
+  // than read indefinitely
+  while(!connection->body_offset) {
+    status = crest_read_line(connection);
+    if(status == CREST_READ_ERROR)
+      break;
+    if((connection->line_end - connection->line_start) >= MAX_LINE_LENGTH) {
+      connection->response_status = connection->request_line_parsed ? 431 : 414;
+      break;
+    }
+    if(status == CREST_READ_MORE) {
+      if(connection->request_data_length < CREST_MAX_REQUEST_HEAD_LENGTH)
+        return CREST_READ_MORE;
+      connection->response_status = 431;
+      break;
+    }
+    
+    if(!connection->request_line_parsed) {
+      // clients with prior knowledge start with the HTTP/2 preface
+      if(crest_h2_preface(connection))
+        return CREST_READ_OK;
+      if(crest_parse_request_line(connection) != CREST_PARSE_OK)
+        break;
+      connection->request_line_parsed = 1;
+      crest_trace(connection, crest_phase_request_line);
+    } else if(crest_parse_header_line(connection) != CREST_PARSE_OK) {
+      break;
+    }
+    
+    connection->line_start = connection->line_end + 1;
+  }
+  
+  crest_set_blocking(connection->client);
+  if(!connection->body_offset) {
+    if(!connection->response_status)
+      connection->response_status = 400;
+    crest_finish(connection);
+    return CREST_READ_OK;
+  }
+  
+  crest_trace(connection, crest_phase_headers);
+  if(crest_h2_upgrade(connection))
+    return CREST_READ_OK;
+  
+  // TODO: read request bodies using content-length. body is NUL
+  // terminated, as it is for HTTP/2 requests
+  connection->body = connection->request_buffer + connection->body_offset;
+  if(!crest_route(connection))
+    connection->response_status = 404;
+  
+  if(!connection->offloaded)
+    crest_finish(connection);
+  return CREST_READ_OK;
+}
+
+// the request head is usually available as soon as the connection
+// is accepted, otherwise the connection waits in pending
+void crest_handle_connection(int server, int client, struct sockaddr_in *address) {
+  char remote_address[INET_ADDRSTRLEN];
+  crest_connection *connection = (crest_connection *) calloc(1, sizeof(crest_connection));
+  clock_gettime(CLOCK_MONOTONIC, &connection->started);
+  crest_trace(connection, crest_phase_accept);
+  connection->server = server;
+  connection->client = client;
+  if(inet_ntop(AF_INET, &address->sin_addr, remote_address, sizeof(remote_address)))
+    connection->remote_address = strdup(remote_address);
+  
+  // TODO: handle malloc error
+  connection->request_buffer = (char *) malloc(MAX_LINE_LENGTH);
+  connection->request_buffer_length = MAX_LINE_LENGTH;
+  connection->line_start = connection->request_buffer;
+  connection->line_end = connection->request_buffer;
+  
+  fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+  if(crest_read_request(connection) == CREST_READ_MORE)
+    pending[pending_count++] = connection;
+}
+
+int crest_pending_pollfds(struct pollfd *fds) {
+  for(int i = 0; i < pending_count; i++) {
+    fds[i].fd = pending[i]->client;
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+  return pending_count;
+}
+
+// read from every ready connection, and drop those that haven't
+// sent a complete request head within CREST_REQUEST_TIMEOUT ms of
+// being accepted
+void crest_handle_pending(struct pollfd *fds, int count) {
+  struct timespec now;
+  long elapsed;
+  int kept = 0;
+  
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for(int i = 0; i < pending_count; i++) {
+    crest_connection *connection = pending[i];
+    if((i < count) && fds[i].revents && (crest_read_request(connection) != CREST_READ_MORE))
+      continue;
+    
+    elapsed = ((now.tv_sec - connection->started.tv_sec) * 1000) + ((now.tv_nsec - connection->started.tv_nsec) / 1000000);
+    if(elapsed >= CREST_REQUEST_TIMEOUT) {
+      crest_free_connection(connection);
+      continue;
+    }
+    
+    pending[kept++] = connection;
+  }
+  pending_count = kept;
+}
+
+void crest_handle_completed(void) {
+  crest_connection *connection = crest_offload_completed(), *next;
+  while(connection) {
+    next = connection->next_completed;
+    crest_finish(connection);
+    connection = next;
+  }
+}
+
+
 /*------------------------------------------------------------*/
 /* server functions                                           */
 /*------------------------------------------------------------*/
-void crest_start_server(int port) {
+static volatile sig_atomic_t stop_requested = 0;
+
+void crest_stop_signal(int signal) {
+  stop_requested = 1;
+}
+
+// serve requests until SIGTERM or SIGINT, then return once
+// buffered access log lines have been written. requests still
+// being handled when the signal arrives are abandoned. returns
+// CREST_SERVER_ERROR if the server couldn't be started
+int crest_start_server(int port) {
+  struct sigaction action;
   struct sockaddr_in servaddr, clientaddr;
-  int error = 0, server, client;
+  int error = 0, server, client, wakeup, reuse = 1;
   socklen_t clientaddr_len;
-  crest_connection connection;
+  struct pollfd fds[2 + CREST_MAX_PENDING_CONNECTIONS + CREST_H2_MAX_SESSIONS];
   
   memset(&servaddr, 0, sizeof(servaddr));
-  clientaddr_len = sizeof(clientaddr);
-  memset(&connection, 0, sizeof(crest_connection));
+  
+  // writes to clients that have disconnected are reported by
+  // write returning an error rather than a signal
+  signal(SIGPIPE, SIG_IGN);
+  
+  // SA_RESTART isn't set so the signals interrupt poll
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = crest_stop_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
   
   // TODO: handle socket error
   server = socket(AF_INET, SOCK_STREAM, 0);
   if(server == -1)
-    return;
+    return CREST_SERVER_ERROR;
+  setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
   
   servaddr.sin_family      = AF_INET;
   servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -249,60 +541,72 @@ void crest_start_server(int port) {
   // TODO: handle bind error
   error = bind(server, (const struct sockaddr *)&servaddr, sizeof(servaddr));
   if(error)
-    return;
+    return CREST_SERVER_ERROR;
   
   // TODO: handle listen error
   error = listen(server, 1000);
   if(error)
-    return;
+    return CREST_SERVER_ERROR;
   
-  while(1) {
-    client = accept(server, (struct sockaddr *)&clientaddr, &clientaddr_len);
-    if(client == -1)
-      continue;
+#ifdef CREST_TRACE
+  if(crest_trace_open() == -1) {
+    fprintf(stderr, "crest: unable to create trace file %s: %s\n", CREST_TRACE_FILE, strerror(errno));
+    return CREST_SERVER_ERROR;
+  }
+#endif
+  
+  wakeup = crest_offload_start();
+  if(wakeup == -1) {
+    fprintf(stderr, "crest: unable to start offload pool: %s\n", strerror(errno));
+    return CREST_SERVER_ERROR;
+  }
+  
+  // the I/O thread waits for new clients on the server socket,
+  // for the offload pool to hand back finished connections, for
+  // the request heads of pending connections, and for frames on
+  // every HTTP/2 session
+  fds[0].fd = server;
+  fds[0].events = POLLIN;
+  fds[1].fd = wakeup;
+  fds[1].events = POLLIN;
+  
+  while(!stop_requested) {
+    // poll wakes at least every CREST_ROUTES_CHECK_INTERVAL ms, and
+    // when interrupted by SIGHUP, so route table changes and
+    // buffered log lines are handled without waiting for a request
+    // new clients wait in the listen backlog while pending is full
+    fds[0].events = (pending_count < CREST_MAX_PENDING_CONNECTIONS) ? POLLIN : 0;
+    fds[0].revents = 0;
+    fds[1].revents = 0;
+    int pending_fds = crest_pending_pollfds(fds + 2);
+    int count = 2 + pending_fds + crest_h2_pollfds(fds + 2 + pending_fds);
     
-    // cleanup old connection
-    // TODO: free connection address once it's being stored
-    if(connection.request_headers_count > 0) {
-      for(int i = 0; i < connection.request_headers_count; i++) {
-        free(connection.request_header_keys[i]);
-        free(connection.request_header_values[i]);
-      }
-      free(connection.request_header_keys);
-      free(connection.request_header_values);
-    }
-
-    if(connection.response_headers_count > 0) {
-      for(int i = 0; i < connection.response_headers_count; i++) {
-        free(connection.response_header_keys[i]);
-        free(connection.response_header_values[i]);
-      }
-      free(connection.response_header_keys);
-      free(connection.response_header_values);
-    }
-
-    if(connection.uri)
-      free(connection.uri);
-
-    if(connection.request_buffer)
-      free(connection.request_buffer);
-
-    if(connection.response_body)
-      free(connection.response_body);
+    poll(fds, count, CREST_ROUTES_CHECK_INTERVAL);
+    crest_routes_check();
+    crest_log_check();
     
-    // initialise new connection
-    memset(&connection, 0, sizeof(crest_connection));
-    connection.server = server;
-    connection.client = client;
+    if(fds[1].revents & POLLIN)
+      crest_handle_completed();
     
-    // TODO: handle read error
-    if(crest_read_line(&connection) != CREST_READ_OK)
-      return;
+    // sessions must be handled before pending connections, as the
+    // HTTP/2 preface and h2c upgrades add sessions
+    crest_h2_handle(fds + 2 + pending_fds, count - 2 - pending_fds);
+    crest_handle_pending(fds + 2, pending_fds);
     
-    // TODO: handle parse error - 400
-    if(crest_parse_request_line(&connection) != CREST_PARSE_OK)
-      return;
+    if(fds[0].revents & POLLIN) {
+      clientaddr_len = sizeof(clientaddr);
+      client = accept(server, (struct sockaddr *)&clientaddr, &clientaddr_len);
+      if(client != -1)
+        crest_handle_connection(server, client, &clientaddr);
+    }
+    
+    // frames queued during this pass are written together
+    crest_h2_flush();
   }
+  
+  close(server);
+  crest_log_flush();
+  return CREST_SERVER_OK;
 }
 
 void crest_write_string(crest_connection *connection, char *data) {
@@ -317,7 +621,37 @@ void crest_write(crest_connection *connection, void *data, int length) {
   memcpy(connection->response_body + old_length, data, length);
 }
 
+// write the status line, headers and body to the client. this is
+// called by the server once a handler returns, but handlers may
+// call it earlier to flush the response themselves. HTTP/2
+// responses are always sent once the handler returns
 void crest_complete(crest_connection *connection) {
+  struct iovec parts[2];
+  int headers_length = 128;
+  char *headers, *ptr;
+  
+  if(connection->completed || connection->stream)
+    return;
+  connection->completed = 1;
+  
+  if(!connection->response_status)
+    connection->response_status = 200;
   
+  for(int i = 0; i < connection->response_headers_count; i++)
+    headers_length += strlen(connection->response_header_keys[i]) + strlen(connection->response_header_values[i]) + 4;
+  
+  headers = ptr = (char *) malloc(headers_length);
+  ptr += sprintf(ptr, "HTTP/1.1 %d %s" CRLF, connection->response_status, crest_status_reason(connection->response_status));
+  ptr += sprintf(ptr, "Content-Length: %d" CRLF "Connection: close" CRLF, connection->response_length);
+  for(int i = 0; i < connection->response_headers_count; i++)
+    ptr += sprintf(ptr, "%s: %s" CRLF, connection->response_header_keys[i], connection->response_header_values[i]);
+  ptr += sprintf(ptr, CRLF);
+  
+  parts[0].iov_base = headers;
+  parts[0].iov_len = ptr - headers;
+  parts[1].iov_base = connection->response_body;
+  parts[1].iov_len = connection->response_length;
+  crest_write_all(connection->client, parts, 2);
+  crest_trace(connection, crest_phase_complete);
+  free(headers);
 }
-
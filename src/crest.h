@@ -1,5 +1,10 @@
 #ifndef __included_crest__
 #define __included_crest__
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
 
 typedef enum {
   http_get,
@@ -11,8 +16,24 @@ typedef enum {
   http_options
 } http_method;
 
-typedef struct {
+#define CREST_METHODS_COUNT 7
+extern const char *crest_method_names[CREST_METHODS_COUNT];
+
+// request phases recorded when built with -DCREST_TRACE
+typedef enum {
+  crest_phase_accept,
+  crest_phase_first_byte,
+  crest_phase_request_line,
+  crest_phase_headers,
+  crest_phase_routed,
+  crest_phase_handled,
+  crest_phase_complete,
+  crest_phase_count
+} crest_phase;
+
+typedef struct crest_connection {
   // request
+  struct timespec started;
   char  *request_buffer;
   char  *line_start;
   char  *line_end;
@@ -24,6 +45,7 @@ typedef struct {
 	char  *uri;
 	int   http_major_version;
 	int   http_minor_version;
+  int   request_line_parsed;  // or :method and :path for HTTP/2
   int   body_offset;
 	char  *body;
 	char  *remote_address;
@@ -37,22 +59,140 @@ typedef struct {
   int   response_headers_count;
   char  *response_body;
   int   response_length;
+  int   response_status;
+  int   completed;
+  
+  // route table the request was matched against
+  void  *routes;
+  
+  // HTTP/2 stream the request arrived on, NULL for HTTP/1.x
+  void  *stream;
+  
+  // offload pool
+  int   offloaded;
+  struct crest_connection *next_completed;
+  
+  // tracing. present in every build so route tables built with
+  // and without CREST_TRACE share the same connection layout
+  uint64_t trace[crest_phase_count];
 } crest_connection;
 
+typedef void (*crest_handler)(crest_connection *connection);
+
 
 /*------------------------------------------------------------*/
 /* external functions                                         */
 /*------------------------------------------------------------*/
+// match_url is either linked in from a generated routes file, or
+// loaded from a shared route table with crest_load_routes
 extern int match_url(char *url, crest_connection *connection);
 
 
 /*------------------------------------------------------------*/
 /* server functions                                           */
 /*------------------------------------------------------------*/
-void crest_start_server(int port);
+int  crest_start_server(int port);
 void crest_write_string(crest_connection *connection, char *data);
 void crest_write(crest_connection *connection, void *data, int length);
 void crest_complete(crest_connection *connection);
+void crest_offload(crest_handler handler, crest_connection *connection);
+int  crest_load_routes(char *path);
+int  crest_open_log(char *path);
+
+
+/*------------------------------------------------------------*/
+/* private server functions                                   */
+/*------------------------------------------------------------*/
+void crest_write_all(int fd, struct iovec *parts, int count);
+int  crest_start_thread(pthread_t *thread, void *(*start)(void *), void *argument);
+void crest_finish(crest_connection *connection);
+void crest_free_connection(crest_connection *connection);
+
+
+/*------------------------------------------------------------*/
+/* offload pool functions                                     */
+/*------------------------------------------------------------*/
+int crest_offload_start(void);
+crest_connection *crest_offload_completed(void);
+
+
+/*------------------------------------------------------------*/
+/* route table functions                                      */
+/*------------------------------------------------------------*/
+int  crest_route(crest_connection *connection);
+void crest_routes_release(crest_connection *connection);
+void crest_routes_check(void);
+
+
+/*------------------------------------------------------------*/
+/* access log functions                                       */
+/*------------------------------------------------------------*/
+void crest_log_request(crest_connection *connection);
+void crest_log_check(void);
+void crest_log_flush(void);
+
+
+/*------------------------------------------------------------*/
+/* HTTP/2 functions                                           */
+/*------------------------------------------------------------*/
+typedef struct crest_hpack_table crest_hpack_table;
+
+crest_hpack_table *crest_hpack_create(void);
+void crest_hpack_destroy(crest_hpack_table *table);
+int  crest_hpack_decode(crest_hpack_table *table, unsigned char *block, int length, crest_connection *connection);
+unsigned char *crest_hpack_encode(crest_connection *connection, int *length);
+
+int  crest_h2_preface(crest_connection *connection);
+int  crest_h2_upgrade(crest_connection *connection);
+int  crest_h2_pollfds(struct pollfd *fds);
+void crest_h2_handle(struct pollfd *fds, int count);
+void crest_h2_flush(void);
+void crest_h2_respond(crest_connection *connection);
+void crest_h2_release(crest_connection *connection);
+
+
+/*------------------------------------------------------------*/
+/* request tracing                                            */
+/*------------------------------------------------------------*/
+// each finished request is written to a ring of records in a
+// memory mapped file, which bin/cresttrace reads. records are
+// guarded by their sequence number (index + 1), which is zeroed
+// while the record is being written.
+#define CREST_TRACE_MAGIC     0x52544352  // "CRTR"
+#define CREST_TRACE_URI_LENGTH  48
+
+typedef struct {
+  uint64_t sequence;
+  uint64_t phases[crest_phase_count];
+  int      status;
+  int      offloaded;
+  char     uri[CREST_TRACE_URI_LENGTH];
+} crest_trace_record;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t record_count;
+  uint32_t worker;
+  uint32_t reserved;
+  uint64_t head;
+  crest_trace_record records[];
+} crest_trace_ring;
+
+#ifdef CREST_TRACE
+// CLOCK_MONOTONIC is read through the vDSO on Linux, so this
+// costs tens of nanoseconds without a system call
+static inline uint64_t crest_trace_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t) now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+#define crest_trace(connection, phase)  ((connection)->trace[phase] = crest_trace_now())
+int  crest_trace_open(void);
+void crest_trace_commit(crest_connection *connection);
+#else
+#define crest_trace(connection, phase)  ((void) 0)
+#endif
 
 
 /*------------------------------------------------------------*/
@@ -61,6 +201,26 @@ void crest_complete(crest_connection *connection);
 #define MAX_URI_LENGTH				(10 * 1024)
 #define MAX_HEADER_KEY_LENGTH 255
 #define MAX_HEADER_VAL_LENGTH	(10 * 1024)
+#define CREST_MAX_PENDING_CONNECTIONS 1024  // connections reading a request head
+#define CREST_MAX_REQUEST_HEAD_LENGTH (64 * 1024) // request line and headers
+#define CREST_MAX_REQUEST_HEADERS 100
+#define CREST_REQUEST_TIMEOUT 10000     // ms to receive a request head
+#define CREST_WRITE_TIMEOUT   1000      // ms a response write may make no progress
+#define CREST_OFFLOAD_THREADS 4
+#define CREST_OFFLOAD_QUEUE_LENGTH  64   // per offload thread
+#define CREST_ROUTES_CHECK_INTERVAL 1000 // ms between route file checks
+#define CREST_LOG_BUFFER_LENGTH (64 * 1024)
+#define CREST_LOG_BUFFERS     8
+#define CREST_LOG_FLUSH_INTERVAL  1000      // ms before a partial buffer is written
+#define CREST_LOG_MAX_FILE_LENGTH (64 * 1024 * 1024)
+#define CREST_H2_MAX_SESSIONS 1024
+#define CREST_H2_MAX_STREAMS  100       // concurrent streams per session
+#define CREST_H2_MAX_BODY_LENGTH  (1024 * 1024)
+#define CREST_H2_MAX_HEADER_BLOCK_LENGTH  (64 * 1024)
+#define CREST_H2_OUTPUT_HIGH_WATER  (256 * 1024)
+#define CREST_HPACK_TABLE_LENGTH  4096
+#define CREST_TRACE_FILE      "crest.trace"
+#define CREST_TRACE_RECORDS   (64 * 1024)
 
 
 /*------------------------------------------------------------*/
@@ -70,6 +230,13 @@ void crest_complete(crest_connection *connection);
 #define CREST_PARSE_OK				1
 #define CREST_READ_ERROR      0
 #define CREST_READ_OK         1
+#define CREST_READ_MORE       2
+#define CREST_LOAD_ERROR      0
+#define CREST_LOAD_OK         1
+#define CREST_LOG_ERROR       0
+#define CREST_LOG_OK          1
+#define CREST_SERVER_ERROR    0
+#define CREST_SERVER_OK       1
 
 
 /*------------------------------------------------------------*/
@@ -0,0 +1,1014 @@
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include "crest.h"
+
+#define H2_PREFACE              "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH       24
+#define H2_PREFACE_LINE_LENGTH  16  // "PRI * HTTP/2.0\r\n"
+#define H2_FRAME_HEADER_LENGTH  9
+#define H2_DEFAULT_WINDOW       65535
+#define H2_DEFAULT_FRAME_LENGTH 16384  // also the largest frame accepted
+#define H2_MAX_FRAME_LENGTH     16777215
+#define H2_MAX_WINDOW           0x7fffffff
+#define H2_INPUT_LENGTH         (4 * (H2_FRAME_HEADER_LENGTH + H2_DEFAULT_FRAME_LENGTH))
+#define H2_READS_PER_POLL       16
+
+// frame types
+#define H2_DATA           0x0
+#define H2_HEADERS        0x1
+#define H2_PRIORITY       0x2
+#define H2_RST_STREAM     0x3
+#define H2_SETTINGS       0x4
+#define H2_PUSH_PROMISE   0x5
+#define H2_PING           0x6
+#define H2_GOAWAY         0x7
+#define H2_WINDOW_UPDATE  0x8
+#define H2_CONTINUATION   0x9
+
+// frame flags
+#define H2_FLAG_END_STREAM  0x1
+#define H2_FLAG_ACK         0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED      0x8
+#define H2_FLAG_PRIORITY    0x20
+
+// settings
+#define H2_SETTINGS_ENABLE_PUSH             0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS  0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE     0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE          0x5
+
+// error codes
+#define H2_PROTOCOL_ERROR       0x1
+#define H2_FLOW_CONTROL_ERROR   0x3
+#define H2_STREAM_CLOSED        0x5
+#define H2_FRAME_SIZE_ERROR     0x6
+#define H2_REFUSED_STREAM       0x7
+#define H2_CANCEL               0x8
+#define H2_COMPRESSION_ERROR    0x9
+#define H2_ENHANCE_YOUR_CALM    0xb
+
+/*------------------------------------------------------------*/
+/* sessions and streams                                       */
+/*------------------------------------------------------------*/
+// each HTTP/2 connection is a session, polled by the I/O thread
+// alongside the server socket. every stream carries its own
+// crest_connection, which is routed through match_url exactly
+// like an HTTP/1.x request once the request has been received.
+// frames are appended to the session's output buffer and
+// written once per pass of the I/O loop.
+typedef struct crest_h2_stream {
+  uint32_t id;
+  crest_connection *connection;
+  struct crest_h2_session *session;
+  int32_t send_window;
+  int32_t receive_window;
+  int body_sent;
+  int request_complete;   // END_STREAM received, request dispatched
+  int responding;         // response headers sent
+  int response_complete;  // END_STREAM sent
+  int released;           // crest_finish is done with the connection
+  int reset;
+  struct crest_h2_stream *next;
+} crest_h2_stream;
+
+typedef struct crest_h2_session {
+  int fd;
+  int closed;
+  int preface_received;
+  char *remote_address;
+  unsigned char *input;
+  int input_length;
+  int input_capacity;
+  unsigned char *output;
+  int output_length;
+  int output_capacity;
+  crest_hpack_table *decoder;
+  crest_h2_stream *streams;
+  int streams_count;
+  uint32_t last_stream_id;
+
+  // a header block spread over HEADERS and CONTINUATION frames.
+  // header_stream is NULL when the stream was refused, but the
+  // block must still be decoded to keep HPACK state in step
+  unsigned char *header_block;
+  int header_block_length;
+  uint32_t header_stream_id;
+  crest_h2_stream *header_stream;
+  int header_end_stream;
+  int header_trailers;
+
+  // flow control. windows are signed as a SETTINGS change can
+  // legitimately take a stream's send window below zero
+  int32_t send_window;
+  int32_t receive_window;
+  int32_t initial_window;
+  uint32_t max_frame_length;
+  struct crest_h2_session *next;
+} crest_h2_session;
+
+static crest_h2_session *sessions = NULL;
+static int sessions_count = 0;
+
+
+/*------------------------------------------------------------*/
+/* private output functions                                   */
+/*------------------------------------------------------------*/
+uint32_t crest_h2_read_uint32(unsigned char *ptr) {
+  return ((uint32_t) ptr[0] << 24) | ((uint32_t) ptr[1] << 16) | ((uint32_t) ptr[2] << 8) | ptr[3];
+}
+
+void crest_h2_write_uint32(unsigned char *ptr, uint32_t value) {
+  ptr[0] = value >> 24;
+  ptr[1] = value >> 16;
+  ptr[2] = value >> 8;
+  ptr[3] = value;
+}
+
+void crest_h2_write_frame(crest_h2_session *session, int type, int flags, uint32_t stream_id, void *payload, int length) {
+  int needed = session->output_length + H2_FRAME_HEADER_LENGTH + length;
+  if(needed > session->output_capacity) {
+    while(session->output_capacity < needed)
+      session->output_capacity = session->output_capacity ? session->output_capacity * 2 : H2_INPUT_LENGTH;
+    session->output = (unsigned char *) realloc(session->output, session->output_capacity);
+  }
+
+  unsigned char *ptr = session->output + session->output_length;
+  ptr[0] = length >> 16;
+  ptr[1] = length >> 8;
+  ptr[2] = length;
+  ptr[3] = type;
+  ptr[4] = flags;
+  crest_h2_write_uint32(ptr + 5, stream_id);
+  if(length)
+    memcpy(ptr + H2_FRAME_HEADER_LENGTH, payload, length);
+  session->output_length = needed;
+}
+
+void crest_h2_send_rst_stream(crest_h2_session *session, uint32_t stream_id, uint32_t error) {
+  unsigned char payload[4];
+  crest_h2_write_uint32(payload, error);
+  crest_h2_write_frame(session, H2_RST_STREAM, 0, stream_id, payload, 4);
+}
+
+void crest_h2_send_window_update(crest_h2_session *session, uint32_t stream_id, uint32_t increment) {
+  unsigned char payload[4];
+  crest_h2_write_uint32(payload, increment);
+  crest_h2_write_frame(session, H2_WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+// connection errors send GOAWAY and close the session once the
+// output buffer has been written
+void crest_h2_error(crest_h2_session *session, uint32_t error) {
+  unsigned char payload[8];
+  crest_h2_write_uint32(payload, session->last_stream_id);
+  crest_h2_write_uint32(payload + 4, error);
+  crest_h2_write_frame(session, H2_GOAWAY, 0, 0, payload, 8);
+  session->closed = 1;
+}
+
+// write as much buffered output as the socket will take
+void crest_h2_write(crest_h2_session *session) {
+  int written = 0;
+  while(written < session->output_length) {
+    ssize_t result = write(session->fd, session->output + written, session->output_length - written);
+    if(result > 0) {
+      written += result;
+    } else if((result == -1) && (errno == EINTR)) {
+      continue;
+    } else if((result == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+      break;
+    } else {
+      session->closed = 1;
+      written = session->output_length;
+    }
+  }
+
+  memmove(session->output, session->output + written, session->output_length - written);
+  session->output_length -= written;
+}
+
+
+/*------------------------------------------------------------*/
+/* private stream functions                                   */
+/*------------------------------------------------------------*/
+crest_h2_stream *crest_h2_find_stream(crest_h2_session *session, uint32_t stream_id) {
+  for(crest_h2_stream *stream = session->streams; stream; stream = stream->next) {
+    if(stream->id == stream_id)
+      return stream;
+  }
+  return NULL;
+}
+
+// streams created for an h2c upgrade reuse the HTTP/1.1
+// request's connection, all others start with a new one
+crest_h2_stream *crest_h2_create_stream(crest_h2_session *session, uint32_t stream_id, crest_connection *connection) {
+  crest_h2_stream *stream = (crest_h2_stream *) calloc(1, sizeof(crest_h2_stream));
+  stream->id = stream_id;
+  stream->session = session;
+  stream->send_window = session->initial_window;
+  stream->receive_window = H2_DEFAULT_WINDOW;
+
+  if(!connection) {
+    connection = (crest_connection *) calloc(1, sizeof(crest_connection));
+    clock_gettime(CLOCK_MONOTONIC, &connection->started);
+    crest_trace(connection, crest_phase_accept);
+    crest_trace(connection, crest_phase_first_byte);
+    connection->http_major_version = 2;
+    if(session->remote_address)
+      connection->remote_address = strdup(session->remote_address);
+  }
+
+  connection->client = -1;
+  connection->stream = stream;
+  stream->connection = connection;
+
+  stream->next = session->streams;
+  session->streams = stream;
+  session->streams_count++;
+  return stream;
+}
+
+void crest_h2_free_stream(crest_h2_stream *stream) {
+  crest_h2_session *session = stream->session;
+  if(session) {
+    crest_h2_stream **link = &session->streams;
+    while(*link != stream)
+      link = &(*link)->next;
+    *link = stream->next;
+    session->streams_count--;
+  }
+
+  crest_free_connection(stream->connection);
+  free(stream);
+}
+
+// dispatched streams are freed once crest_finish has released
+// them and nothing more will be sent
+void crest_h2_check_stream(crest_h2_stream *stream) {
+  if(stream->released && (stream->reset || !stream->session || stream->response_complete))
+    crest_h2_free_stream(stream);
+}
+
+// a reset stream that hasn't been dispatched can be freed now.
+// dispatched streams may have a handler running on the offload
+// pool, so they're only freed once released
+void crest_h2_cancel_stream(crest_h2_stream *stream) {
+  stream->reset = 1;
+  if(!stream->request_complete)
+    crest_h2_free_stream(stream);
+  else
+    crest_h2_check_stream(stream);
+}
+
+void crest_h2_reset_stream(crest_h2_stream *stream, uint32_t error) {
+  crest_h2_send_rst_stream(stream->session, stream->id, error);
+  crest_h2_cancel_stream(stream);
+}
+
+void crest_h2_send_data(crest_h2_stream *stream) {
+  crest_h2_session *session = stream->session;
+  crest_connection *connection = stream->connection;
+
+  while(stream->body_sent < connection->response_length) {
+    int length = connection->response_length - stream->body_sent;
+    if(length > (int) session->max_frame_length)
+      length = session->max_frame_length;
+    if(length > stream->send_window)
+      length = stream->send_window;
+    if(length > session->send_window)
+      length = session->send_window;
+
+    // wait for a WINDOW_UPDATE, or for the output to drain
+    if((length <= 0) || (session->output_length >= CREST_H2_OUTPUT_HIGH_WATER))
+      return;
+
+    int flags = (stream->body_sent + length == connection->response_length) ? H2_FLAG_END_STREAM : 0;
+    crest_h2_write_frame(session, H2_DATA, flags, stream->id, connection->response_body + stream->body_sent, length);
+    stream->body_sent += length;
+    stream->send_window -= length;
+    session->send_window -= length;
+  }
+
+  stream->response_complete = 1;
+}
+
+void crest_h2_send_pending(crest_h2_session *session) {
+  crest_h2_stream *stream = session->streams, *next;
+  while(stream) {
+    next = stream->next;
+    if(stream->responding && !stream->response_complete && !stream->reset)
+      crest_h2_send_data(stream);
+    crest_h2_check_stream(stream);
+    stream = next;
+  }
+}
+
+void crest_h2_dispatch(crest_h2_stream *stream) {
+  crest_connection *connection = stream->connection;
+  stream->request_complete = 1;
+
+  // request_buffer holds the body received in DATA frames, other
+  // than for the upgraded stream, which already has its body set
+  if(!connection->body)
+    connection->body = connection->request_buffer;
+
+  // requests without a :path, or with malformed headers, have
+  // already been given a 400 status and aren't routed
+  if(!connection->uri) {
+    connection->response_status = 400;
+    connection->request_line_parsed = 0;
+  }
+  if(!connection->response_status && !crest_route(connection))
+    connection->response_status = 404;
+
+  if(!connection->offloaded)
+    crest_finish(connection);
+}
+
+
+/*------------------------------------------------------------*/
+/* private frame functions                                    */
+/*------------------------------------------------------------*/
+int crest_h2_unpad(unsigned char **payload, int *length, int flags) {
+  if(!(flags & H2_FLAG_PADDED))
+    return CREST_PARSE_OK;
+  if(*length < 1)
+    return CREST_PARSE_ERROR;
+
+  int padding = (*payload)[0];
+  if(padding >= *length)
+    return CREST_PARSE_ERROR;
+  (*payload)++;
+  *length -= 1 + padding;
+  return CREST_PARSE_OK;
+}
+
+int crest_h2_apply_settings(crest_h2_session *session, unsigned char *payload, int length) {
+  for(int i = 0; i + 6 <= length; i += 6) {
+    int setting = (payload[i] << 8) | payload[i + 1];
+    uint32_t value = crest_h2_read_uint32(payload + i + 2);
+
+    switch(setting) {
+      case H2_SETTINGS_ENABLE_PUSH:
+        if(value > 1) {
+          crest_h2_error(session, H2_PROTOCOL_ERROR);
+          return CREST_PARSE_ERROR;
+        }
+        break;
+
+      // a change in initial window size applies to the send
+      // window of every open stream
+      case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+        if(value > H2_MAX_WINDOW) {
+          crest_h2_error(session, H2_FLOW_CONTROL_ERROR);
+          return CREST_PARSE_ERROR;
+        }
+        for(crest_h2_stream *stream = session->streams; stream; stream = stream->next) {
+          int64_t window = (int64_t) stream->send_window + ((int64_t) value - session->initial_window);
+          if(window > H2_MAX_WINDOW) {
+            crest_h2_error(session, H2_FLOW_CONTROL_ERROR);
+            return CREST_PARSE_ERROR;
+          }
+          stream->send_window = (int32_t) window;
+        }
+        session->initial_window = value;
+        break;
+
+      case H2_SETTINGS_MAX_FRAME_SIZE:
+        if((value < H2_DEFAULT_FRAME_LENGTH) || (value > H2_MAX_FRAME_LENGTH)) {
+          crest_h2_error(session, H2_PROTOCOL_ERROR);
+          return CREST_PARSE_ERROR;
+        }
+        session->max_frame_length = value;
+        break;
+
+      // header table size only limits an encoder's dynamic table,
+      // and responses are encoded without one. other settings
+      // either limit server push, which isn't used, or are unknown
+      default:
+        break;
+    }
+  }
+
+  return CREST_PARSE_OK;
+}
+
+void crest_h2_header_block_complete(crest_h2_session *session) {
+  crest_h2_stream *stream = session->header_stream;
+  crest_connection *connection = (stream && !session->header_trailers) ? stream->connection : NULL;
+  uint32_t stream_id = session->header_stream_id;
+  session->header_stream_id = 0;
+
+  if(crest_hpack_decode(session->decoder, session->header_block, session->header_block_length, connection) != CREST_PARSE_OK) {
+    crest_h2_error(session, H2_COMPRESSION_ERROR);
+    return;
+  }
+
+  if(!stream) {
+    crest_h2_send_rst_stream(session, stream_id, H2_REFUSED_STREAM);
+    return;
+  }
+
+  if(connection) {
+    crest_trace(connection, crest_phase_request_line);
+    crest_trace(connection, crest_phase_headers);
+  }
+
+  if(session->header_end_stream)
+    crest_h2_dispatch(stream);
+}
+
+void crest_h2_header_fragment(crest_h2_session *session, unsigned char *payload, int length, int flags) {
+  if(session->header_block_length + length > CREST_H2_MAX_HEADER_BLOCK_LENGTH) {
+    crest_h2_error(session, H2_ENHANCE_YOUR_CALM);
+    return;
+  }
+
+  session->header_block = (unsigned char *) realloc(session->header_block, session->header_block_length + length + 1);
+  memcpy(session->header_block + session->header_block_length, payload, length);
+  session->header_block_length += length;
+
+  if(flags & H2_FLAG_END_HEADERS)
+    crest_h2_header_block_complete(session);
+}
+
+void crest_h2_headers(crest_h2_session *session, int flags, uint32_t stream_id, unsigned char *payload, int length) {
+  if((stream_id == 0) || !(stream_id & 1) || (crest_h2_unpad(&payload, &length, flags) != CREST_PARSE_OK)) {
+    crest_h2_error(session, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  // stream dependency and weight are ignored
+  if(flags & H2_FLAG_PRIORITY) {
+    if(length < 5) {
+      crest_h2_error(session, H2_PROTOCOL_ERROR);
+      return;
+    }
+    payload += 5;
+    length -= 5;
+  }
+
+  crest_h2_stream *stream = crest_h2_find_stream(session, stream_id);
+  session->header_trailers = 0;
+
+  if(stream) {
+    // trailers must end a request that is still being received
+    if(stream->request_complete || !(flags & H2_FLAG_END_STREAM)) {
+      crest_h2_error(session, H2_PROTOCOL_ERROR);
+      return;
+    }
+    session->header_trailers = 1;
+
+  } else if(stream_id <= session->last_stream_id) {
+    crest_h2_error(session, H2_STREAM_CLOSED);
+    return;
+
+  } else {
+    session->last_stream_id = stream_id;
+    if(session->streams_count < CREST_H2_MAX_STREAMS)
+      stream = crest_h2_create_stream(session, stream_id, NULL);
+  }
+
+  session->header_stream = stream;
+  session->header_stream_id = stream_id;
+  session->header_end_stream = flags & H2_FLAG_END_STREAM;
+  session->header_block_length = 0;
+  crest_h2_header_fragment(session, payload, length, flags);
+}
+
+void crest_h2_data(crest_h2_session *session, int flags, uint32_t stream_id, unsigned char *payload, int length) {
+  // padding counts towards flow control
+  int flow_length = length;
+
+  if((stream_id == 0) || (crest_h2_unpad(&payload, &length, flags) != CREST_PARSE_OK)) {
+    crest_h2_error(session, H2_PROTOCOL_ERROR);
+    return;
+  }
+
+  // the connection window is replenished in batches of at least
+  // half the window, regardless of what happens to the stream
+  session->receive_window -= flow_length;
+  if(session->receive_window < 0) {
+    crest_h2_error(session, H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+  if(session->receive_window <= H2_DEFAULT_WINDOW / 2) {
+    crest_h2_send_window_update(session, 0, H2_DEFAULT_WINDOW - session->receive_window);
+    session->receive_window = H2_DEFAULT_WINDOW;
+  }
+
+  // data for streams that were reset or refused is dropped
+  crest_h2_stream *stream = crest_h2_find_stream(session, stream_id);
+  if(!stream || stream->request_complete) {
+    if(stream_id > session->last_stream_id)
+      crest_h2_error(session, H2_PROTOCOL_ERROR);
+    else if(stream)
+      crest_h2_send_rst_stream(session, stream_id, H2_STREAM_CLOSED);
+    return;
+  }
+
+  stream->receive_window -= flow_length;
+  if(stream->receive_window < 0) {
+    crest_h2_reset_stream(stream, H2_FLOW_CONTROL_ERROR);
+    return;
+  }
+
+  crest_connection *connection = stream->connection;
+  if(connection->request_data_length + length > CREST_H2_MAX_BODY_LENGTH) {
+    crest_h2_reset_stream(stream, H2_CANCEL);
+    return;
+  }
+
+  // the request body is kept NUL terminated in request_buffer
+  connection->request_buffer = (char *) realloc(connection->request_buffer, connection->request_data_length + length + 1);
+  memcpy(connection->request_buffer + connection->request_data_length, payload, length);
+  connection->request_data_length += length;
+  connection->request_buffer_length = connection->request_data_length + 1;
+  connection->request_buffer[connection->request_data_length] = 0;
+
+  if(flags & H2_FLAG_END_STREAM) {
+    crest_h2_dispatch(stream);
+  } else if(stream->receive_window <= H2_DEFAULT_WINDOW / 2) {
+    crest_h2_send_window_update(session, stream_id, H2_DEFAULT_WINDOW - stream->receive_window);
+    stream->receive_window = H2_DEFAULT_WINDOW;
+  }
+}
+
+void crest_h2_window_update(crest_h2_session *session, uint32_t stream_id, unsigned char *payload, int length) {
+  if(length != 4) {
+    crest_h2_error(session, H2_FRAME_SIZE_ERROR);
+    return;
+  }
+
+  uint32_t increment = crest_h2_read_uint32(payload) & H2_MAX_WINDOW;
+  if(stream_id == 0) {
+    if((increment == 0) || ((int64_t) session->send_window + increment > H2_MAX_WINDOW)) {
+      crest_h2_error(session, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+      return;
+    }
+    session->send_window += increment;
+
+  } else {
+    // updates for streams that have already closed are ignored
+    crest_h2_stream *stream = crest_h2_find_stream(session, stream_id);
+    if(!stream)
+      return;
+
+    if((increment == 0) || ((int64_t) stream->send_window + increment > H2_MAX_WINDOW)) {
+      crest_h2_reset_stream(stream, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+      return;
+    }
+    stream->send_window += increment;
+  }
+
+  crest_h2_send_pending(session);
+}
+
+void crest_h2_frame(crest_h2_session *session, int type, int flags, uint32_t stream_id, unsigned char *payload, int length) {
+  crest_h2_stream *stream;
+
+  switch(type) {
+    case H2_DATA:
+      crest_h2_data(session, flags, stream_id, payload, length);
+      break;
+
+    case H2_HEADERS:
+      crest_h2_headers(session, flags, stream_id, payload, length);
+      break;
+
+    case H2_CONTINUATION:
+      if((session->header_stream_id == 0) || (stream_id != session->header_stream_id))
+        crest_h2_error(session, H2_PROTOCOL_ERROR);
+      else
+        crest_h2_header_fragment(session, payload, length, flags);
+      break;
+
+    // priorities are accepted but ignored
+    case H2_PRIORITY:
+      if(stream_id == 0) {
+        crest_h2_error(session, H2_PROTOCOL_ERROR);
+      } else if(length != 5) {
+        if((stream = crest_h2_find_stream(session, stream_id)))
+          crest_h2_reset_stream(stream, H2_FRAME_SIZE_ERROR);
+        else
+          crest_h2_send_rst_stream(session, stream_id, H2_FRAME_SIZE_ERROR);
+      }
+      break;
+
+    case H2_RST_STREAM:
+      if(length != 4)
+        crest_h2_error(session, H2_FRAME_SIZE_ERROR);
+      else if((stream_id == 0) || (stream_id > session->last_stream_id))
+        crest_h2_error(session, H2_PROTOCOL_ERROR);
+      else if((stream = crest_h2_find_stream(session, stream_id)))
+        crest_h2_cancel_stream(stream);
+      break;
+
+    case H2_SETTINGS:
+      if(stream_id != 0)
+        crest_h2_error(session, H2_PROTOCOL_ERROR);
+      else if((flags & H2_FLAG_ACK) ? (length != 0) : ((length % 6) != 0))
+        crest_h2_error(session, H2_FRAME_SIZE_ERROR);
+      else if(!(flags & H2_FLAG_ACK) && (crest_h2_apply_settings(session, payload, length) == CREST_PARSE_OK)) {
+        crest_h2_write_frame(session, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        crest_h2_send_pending(session);
+      }
+      break;
+
+    case H2_PING:
+      if(length != 8)
+        crest_h2_error(session, H2_FRAME_SIZE_ERROR);
+      else if(stream_id != 0)
+        crest_h2_error(session, H2_PROTOCOL_ERROR);
+      else if(!(flags & H2_FLAG_ACK))
+        crest_h2_write_frame(session, H2_PING, H2_FLAG_ACK, 0, payload, 8);
+      break;
+
+    // the peer closes the connection once its streams finish
+    case H2_GOAWAY:
+      if(stream_id != 0)
+        crest_h2_error(session, H2_PROTOCOL_ERROR);
+      break;
+
+    case H2_WINDOW_UPDATE:
+      crest_h2_window_update(session, stream_id, payload, length);
+      break;
+
+    // clients can't push
+    case H2_PUSH_PROMISE:
+      crest_h2_error(session, H2_PROTOCOL_ERROR);
+      break;
+
+    // unknown frame types must be ignored
+    default:
+      break;
+  }
+}
+
+
+/*------------------------------------------------------------*/
+/* private session functions                                  */
+/*------------------------------------------------------------*/
+// process every complete frame in the input buffer
+void crest_h2_process(crest_h2_session *session) {
+  int offset = 0;
+
+  while(!session->closed) {
+    unsigned char *frame = session->input + offset;
+    int available = session->input_length - offset;
+
+    // anything other than the connection preface isn't HTTP/2
+    if(!session->preface_received) {
+      int length = (available < H2_PREFACE_LENGTH) ? available : H2_PREFACE_LENGTH;
+      if(memcmp(frame, H2_PREFACE, length) != 0) {
+        session->closed = 1;
+        break;
+      }
+      if(available < H2_PREFACE_LENGTH)
+        break;
+      session->preface_received = 1;
+      offset += H2_PREFACE_LENGTH;
+      continue;
+    }
+
+    if(available < H2_FRAME_HEADER_LENGTH)
+      break;
+
+    int length = (frame[0] << 16) | (frame[1] << 8) | frame[2];
+    int type = frame[3], flags = frame[4];
+    uint32_t stream_id = crest_h2_read_uint32(frame + 5) & H2_MAX_WINDOW;
+
+    if(length > H2_DEFAULT_FRAME_LENGTH) {
+      crest_h2_error(session, H2_FRAME_SIZE_ERROR);
+      break;
+    }
+    if(available < H2_FRAME_HEADER_LENGTH + length)
+      break;
+
+    // nothing may come between a HEADERS frame and the
+    // CONTINUATION frames that complete its header block
+    if(session->header_stream_id && (type != H2_CONTINUATION)) {
+      crest_h2_error(session, H2_PROTOCOL_ERROR);
+      break;
+    }
+
+    crest_h2_frame(session, type, flags, stream_id, frame + H2_FRAME_HEADER_LENGTH, length);
+    offset += H2_FRAME_HEADER_LENGTH + length;
+  }
+
+  memmove(session->input, session->input + offset, session->input_length - offset);
+  session->input_length -= offset;
+}
+
+// frames like PING and SETTINGS are answered as they're read, so
+// reading stops while the peer isn't reading what's been queued
+void crest_h2_read(crest_h2_session *session) {
+  for(int reads = 0; (reads < H2_READS_PER_POLL) && !session->closed; reads++) {
+    if(session->output_length >= CREST_H2_OUTPUT_HIGH_WATER)
+      break;
+
+    ssize_t result = read(session->fd, session->input + session->input_length, session->input_capacity - session->input_length);
+    if(result > 0) {
+      session->input_length += result;
+      crest_h2_process(session);
+    } else if((result == -1) && (errno == EINTR)) {
+      continue;
+    } else if((result == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+      break;
+    } else {
+      session->closed = 1;
+    }
+  }
+}
+
+// sessions take over the client socket of the HTTP/1.x connection
+// they started from, along with any bytes read beyond the request
+crest_h2_session *crest_h2_create_session(crest_connection *connection, char *data, int length) {
+  unsigned char settings[6];
+
+  if(sessions_count >= CREST_H2_MAX_SESSIONS)
+    return NULL;
+
+  crest_h2_session *session = (crest_h2_session *) calloc(1, sizeof(crest_h2_session));
+  session->fd = connection->client;
+  session->decoder = crest_hpack_create();
+  session->input_capacity = (length > H2_INPUT_LENGTH) ? length : H2_INPUT_LENGTH;
+  session->input = (unsigned char *) malloc(session->input_capacity);
+  memcpy(session->input, data, length);
+  session->input_length = length;
+  session->send_window = H2_DEFAULT_WINDOW;
+  session->receive_window = H2_DEFAULT_WINDOW;
+  session->initial_window = H2_DEFAULT_WINDOW;
+  session->max_frame_length = H2_DEFAULT_FRAME_LENGTH;
+  if(connection->remote_address)
+    session->remote_address = strdup(connection->remote_address);
+
+  fcntl(session->fd, F_SETFL, fcntl(session->fd, F_GETFL) | O_NONBLOCK);
+  connection->client = -1;
+
+  session->next = sessions;
+  sessions = session;
+  sessions_count++;
+
+  // the server's SETTINGS must be the first frame it sends
+  settings[0] = 0;
+  settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  crest_h2_write_uint32(settings + 2, CREST_H2_MAX_STREAMS);
+  crest_h2_write_frame(session, H2_SETTINGS, 0, 0, settings, 6);
+  return session;
+}
+
+// streams with a handler still running on the offload pool are
+// detached from the session, and freed once released
+void crest_h2_close_session(crest_h2_session *session) {
+  crest_h2_stream *stream = session->streams, *next;
+  while(stream) {
+    next = stream->next;
+    if(!stream->request_complete) {
+      crest_h2_free_stream(stream);
+    } else {
+      stream->session = NULL;
+      crest_h2_check_stream(stream);
+    }
+    stream = next;
+  }
+
+  crest_h2_session **link = &sessions;
+  while(*link != session)
+    link = &(*link)->next;
+  *link = session->next;
+  sessions_count--;
+
+  close(session->fd);
+  crest_hpack_destroy(session->decoder);
+  free(session->remote_address);
+  free(session->header_block);
+  free(session->input);
+  free(session->output);
+  free(session);
+}
+
+int crest_h2_has_token(char *value, char *token) {
+  int length = strlen(token);
+  while(*value) {
+    while((*value == ' ') || (*value == '\t') || (*value == ','))
+      value++;
+    if((strncasecmp(value, token, length) == 0) && ((value[length] == 0) || (value[length] == ',') || (value[length] == ' ')))
+      return 1;
+    while(*value && (*value != ','))
+      value++;
+  }
+  return 0;
+}
+
+char *crest_h2_request_header(crest_connection *connection, char *name) {
+  for(int i = 0; i < connection->request_headers_count; i++) {
+    if(strcasecmp(connection->request_header_keys[i], name) == 0)
+      return connection->request_header_values[i];
+  }
+  return NULL;
+}
+
+// HTTP2-Settings is a base64url encoded SETTINGS payload
+int crest_h2_base64url(char *input, unsigned char *output) {
+  uint32_t bits = 0;
+  int count = 0, length = 0, value;
+
+  for(; *input && (*input != '='); input++) {
+    char c = *input;
+    if((c >= 'A') && (c <= 'Z'))
+      value = c - 'A';
+    else if((c >= 'a') && (c <= 'z'))
+      value = c - 'a' + 26;
+    else if((c >= '0') && (c <= '9'))
+      value = c - '0' + 52;
+    else if((c == '-') || (c == '+'))
+      value = 62;
+    else if((c == '_') || (c == '/'))
+      value = 63;
+    else
+      return -1;
+
+    bits = (bits << 6) | value;
+    count += 6;
+    if(count >= 8) {
+      count -= 8;
+      output[length++] = (bits >> count) & 0xff;
+    }
+  }
+
+  return length;
+}
+
+
+/*------------------------------------------------------------*/
+/* HTTP/2 functions                                           */
+/*------------------------------------------------------------*/
+// prior knowledge: the request line of an HTTP/1.x connection is
+// the start of the HTTP/2 connection preface. returns 1 when the
+// connection has been taken over (or refused), 0 otherwise
+int crest_h2_preface(crest_connection *connection) {
+  int available = (connection->request_buffer + connection->request_data_length) - connection->line_start;
+  if((available < H2_PREFACE_LINE_LENGTH) || (strncmp(connection->line_start, H2_PREFACE, H2_PREFACE_LINE_LENGTH) != 0))
+    return 0;
+
+  crest_h2_session *session = crest_h2_create_session(connection, connection->line_start, available);
+  crest_free_connection(connection);
+  if(session)
+    crest_h2_process(session);
+  return 1;
+}
+
+// h2c upgrade: the HTTP/1.1 request is answered with 101, and
+// becomes stream 1 of the new session. requests with a body
+// aren't upgraded, as bodies aren't read before routing
+int crest_h2_upgrade(crest_connection *connection) {
+  char *upgrade = crest_h2_request_header(connection, "upgrade");
+  char *settings = crest_h2_request_header(connection, "http2-settings");
+  char *content_length = crest_h2_request_header(connection, "content-length");
+  char *response = "HTTP/1.1 101 Switching Protocols" CRLF "Connection: Upgrade" CRLF "Upgrade: h2c" CRLF CRLF;
+  struct iovec part;
+
+  if(!upgrade || !settings || !crest_h2_has_token(upgrade, "h2c"))
+    return 0;
+  if((content_length && (atoi(content_length) != 0)) || crest_h2_request_header(connection, "transfer-encoding"))
+    return 0;
+  if(sessions_count >= CREST_H2_MAX_SESSIONS)
+    return 0;
+
+  unsigned char *payload = (unsigned char *) malloc(strlen(settings) + 1);
+  int payload_length = crest_h2_base64url(settings, payload);
+  if((payload_length < 0) || (payload_length % 6)) {
+    free(payload);
+    return 0;
+  }
+
+  part.iov_base = response;
+  part.iov_len = strlen(response);
+  crest_write_all(connection->client, &part, 1);
+
+  char *body = connection->request_buffer + connection->body_offset;
+  int remaining = connection->request_data_length - connection->body_offset;
+  crest_h2_session *session = crest_h2_create_session(connection, body, remaining);
+  crest_h2_apply_settings(session, payload, payload_length);
+  free(payload);
+
+  // bytes after the request head now belong to the session, so
+  // stream 1 is left with an empty body
+  connection->request_data_length = connection->body_offset;
+  connection->request_buffer_length = connection->body_offset + 1;
+  connection->request_buffer = (char *) realloc(connection->request_buffer, connection->request_buffer_length);
+  connection->request_buffer[connection->body_offset] = 0;
+  connection->body = connection->request_buffer + connection->body_offset;
+
+  session->last_stream_id = 1;
+  crest_h2_stream *stream = crest_h2_create_stream(session, 1, connection);
+  crest_h2_dispatch(stream);
+  crest_h2_process(session);
+  return 1;
+}
+
+// fill fds with every session's socket, in session order. sessions
+// with output above the high water mark only wait to write, which
+// bounds the memory a peer that never reads can make us queue
+int crest_h2_pollfds(struct pollfd *fds) {
+  int count = 0;
+  for(crest_h2_session *session = sessions; session; session = session->next) {
+    fds[count].fd = session->fd;
+    if(session->output_length >= CREST_H2_OUTPUT_HIGH_WATER)
+      fds[count].events = POLLOUT;
+    else
+      fds[count].events = POLLIN | (session->output_length ? POLLOUT : 0);
+    fds[count].revents = 0;
+    count++;
+  }
+  return count;
+}
+
+// sessions aren't added or removed between crest_h2_pollfds and
+// crest_h2_handle, so fds still line up with the session list
+void crest_h2_handle(struct pollfd *fds, int count) {
+  crest_h2_session *session = sessions;
+  for(int i = 0; (i < count) && session; i++, session = session->next) {
+    if(fds[i].revents & POLLOUT)
+      crest_h2_write(session);
+    if(fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+      crest_h2_read(session);
+  }
+}
+
+// write the frames queued by every session this pass of the I/O
+// loop, then close sessions that have finished
+void crest_h2_flush(void) {
+  crest_h2_session *session = sessions, *next;
+  while(session) {
+    next = session->next;
+    if(session->output_length)
+      crest_h2_write(session);
+
+    // responses held back by the output high water mark
+    if(!session->closed && (session->output_length < CREST_H2_OUTPUT_HIGH_WATER)) {
+      crest_h2_send_pending(session);
+      if(session->output_length)
+        crest_h2_write(session);
+    }
+
+    if(session->closed)
+      crest_h2_close_session(session);
+    session = next;
+  }
+}
+
+// queue the response for a stream whose handler has returned.
+// called by crest_finish on the I/O thread
+void crest_h2_respond(crest_connection *connection) {
+  crest_h2_stream *stream = (crest_h2_stream *) connection->stream;
+  crest_h2_session *session = stream->session;
+  int length, offset = 0, type = H2_HEADERS;
+
+  connection->completed = 1;
+  if(!connection->response_status)
+    connection->response_status = 200;
+  if(stream->reset || !session)
+    return;
+
+  // header blocks larger than a frame continue in CONTINUATION
+  // frames, which must follow the HEADERS frame immediately
+  unsigned char *block = crest_hpack_encode(connection, &length);
+  do {
+    int chunk = length - offset;
+    if(chunk > (int) session->max_frame_length)
+      chunk = session->max_frame_length;
+
+    int flags = (offset + chunk == length) ? H2_FLAG_END_HEADERS : 0;
+    if((type == H2_HEADERS) && (connection->response_length == 0))
+      flags |= H2_FLAG_END_STREAM;
+
+    crest_h2_write_frame(session, type, flags, stream->id, block + offset, chunk);
+    offset += chunk;
+    type = H2_CONTINUATION;
+  } while(offset < length);
+  free(block);
+
+  stream->responding = 1;
+  if(connection->response_length == 0)
+    stream->response_complete = 1;
+  else
+    crest_h2_send_data(stream);
+  crest_trace(connection, crest_phase_complete);
+}
+
+// called by crest_finish once the connection has been logged. the
+// stream is freed now, or once the rest of the response is sent
+void crest_h2_release(crest_connection *connection) {
+  crest_h2_stream *stream = (crest_h2_stream *) connection->stream;
+  stream->released = 1;
+  crest_h2_check_stream(stream);
+}
@@ -0,0 +1,521 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include "crest.h"
+
+#define HPACK_ENTRY_OVERHEAD  32
+#define HPACK_MAX_ENTRIES     (CREST_HPACK_TABLE_LENGTH / HPACK_ENTRY_OVERHEAD)
+#define HUFFMAN_SYMBOLS       257
+#define HUFFMAN_EOS           256
+#define HUFFMAN_MAX_BITS      30
+
+/*------------------------------------------------------------*/
+/* static table (RFC 7541 appendix A)                         */
+/*------------------------------------------------------------*/
+typedef struct {
+  const char *name;
+  const char *value;
+} crest_hpack_header;
+
+static const crest_hpack_header static_table[] = {
+  {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+  {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+  {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+  {":status", "206"}, {":status", "304"}, {":status", "400"},
+  {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+  {"accept-ranges", ""}, {"accept", ""},
+  {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+  {"authorization", ""}, {"cache-control", ""},
+  {"content-disposition", ""}, {"content-encoding", ""},
+  {"content-language", ""}, {"content-length", ""},
+  {"content-location", ""}, {"content-range", ""},
+  {"content-type", ""}, {"cookie", ""}, {"date", ""}, {"etag", ""},
+  {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+  {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""},
+  {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+  {"link", ""}, {"location", ""}, {"max-forwards", ""},
+  {"proxy-authenticate", ""}, {"proxy-authorization", ""},
+  {"range", ""}, {"referer", ""}, {"refresh", ""},
+  {"retry-after", ""}, {"server", ""}, {"set-cookie", ""},
+  {"strict-transport-security", ""}, {"transfer-encoding", ""},
+  {"user-agent", ""}, {"vary", ""}, {"via", ""},
+  {"www-authenticate", ""}
+};
+
+#define STATIC_TABLE_LENGTH   61
+#define STATIC_STATUS_INDEX   8     // :status 200
+#define STATIC_CONTENT_LENGTH_INDEX 28
+
+
+/*------------------------------------------------------------*/
+/* huffman code (RFC 7541 appendix B)                         */
+/*------------------------------------------------------------*/
+// the HPACK huffman code is canonical, so only the code length
+// of each symbol is needed - the codes themselves are assigned
+// in order of length, then symbol
+static const unsigned char huffman_lengths[HUFFMAN_SYMBOLS] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30
+};
+
+static uint32_t huffman_first[HUFFMAN_MAX_BITS + 1];
+static int huffman_counts[HUFFMAN_MAX_BITS + 1];
+static int huffman_offsets[HUFFMAN_MAX_BITS + 1];
+static short huffman_symbols[HUFFMAN_SYMBOLS];
+static int huffman_ready = 0;
+
+
+/*------------------------------------------------------------*/
+/* dynamic table                                              */
+/*------------------------------------------------------------*/
+// entries are kept in a ring, newest first. every entry costs at
+// least HPACK_ENTRY_OVERHEAD bytes, so the ring can never hold
+// more than HPACK_MAX_ENTRIES entries
+typedef struct {
+  char *name;
+  char *value;
+  int  name_length;
+  int  size;
+} crest_hpack_entry;
+
+struct crest_hpack_table {
+  crest_hpack_entry entries[HPACK_MAX_ENTRIES];
+  int first;
+  int count;
+  int size;
+  int max_size;
+};
+
+
+/*------------------------------------------------------------*/
+/* private huffman functions                                  */
+/*------------------------------------------------------------*/
+void crest_huffman_init(void) {
+  uint32_t code = 0;
+  int index = 0;
+
+  for(int length = 1; length <= HUFFMAN_MAX_BITS; length++) {
+    huffman_first[length] = code;
+    huffman_offsets[length] = index;
+    for(int symbol = 0; symbol < HUFFMAN_SYMBOLS; symbol++) {
+      if(huffman_lengths[symbol] == length) {
+        huffman_symbols[index++] = symbol;
+        code++;
+      }
+    }
+    huffman_counts[length] = index - huffman_offsets[length];
+    code <<= 1;
+  }
+
+  huffman_ready = 1;
+}
+
+// decode one bit at a time. because the code is canonical, a
+// code of a given length is complete when it falls within the
+// range of codes assigned to that length
+char *crest_huffman_decode(unsigned char *data, int length, int *output_length) {
+  char *output = (char *) malloc(((length * 8) / 5) + 1), *ptr = output;
+  uint32_t code = 0;
+  int bits = 0;
+
+  for(int i = 0; i < length; i++) {
+    for(int bit = 7; bit >= 0; bit--) {
+      code = (code << 1) | ((data[i] >> bit) & 1);
+      bits++;
+
+      if((code >= huffman_first[bits]) && ((code - huffman_first[bits]) < (uint32_t) huffman_counts[bits])) {
+        int symbol = huffman_symbols[huffman_offsets[bits] + (code - huffman_first[bits])];
+        if(symbol == HUFFMAN_EOS)
+          goto error;
+        *ptr++ = (char) symbol;
+        code = 0;
+        bits = 0;
+      } else if(bits == HUFFMAN_MAX_BITS) {
+        goto error;
+      }
+    }
+  }
+
+  // the final byte is padded with the most significant bits of
+  // EOS (all ones), and padding can't be a whole byte or more
+  if((bits > 7) || (code != ((1U << bits) - 1)))
+    goto error;
+
+  *ptr = 0;
+  *output_length = ptr - output;
+  return output;
+
+error:
+  free(output);
+  return NULL;
+}
+
+
+/*------------------------------------------------------------*/
+/* private decoding functions                                 */
+/*------------------------------------------------------------*/
+int crest_hpack_integer(unsigned char **ptr, unsigned char *end, int prefix_bits, uint32_t *value) {
+  uint32_t mask = (1U << prefix_bits) - 1;
+  uint64_t result;
+
+  if(*ptr >= end)
+    return CREST_PARSE_ERROR;
+  result = *(*ptr)++ & mask;
+  if(result < mask) {
+    *value = (uint32_t) result;
+    return CREST_PARSE_OK;
+  }
+
+  for(int shift = 0; shift <= 28; shift += 7) {
+    if(*ptr >= end)
+      return CREST_PARSE_ERROR;
+    unsigned char byte = *(*ptr)++;
+    result += (uint64_t)(byte & 127) << shift;
+    if(!(byte & 128)) {
+      if(result > INT32_MAX)
+        return CREST_PARSE_ERROR;
+      *value = (uint32_t) result;
+      return CREST_PARSE_OK;
+    }
+  }
+
+  return CREST_PARSE_ERROR;
+}
+
+// returns a new NUL terminated string, or NULL on error. the
+// string may itself contain NULs, so its decoded length is
+// returned as well
+char *crest_hpack_string(unsigned char **ptr, unsigned char *end, int *string_length) {
+  uint32_t length;
+  char *string;
+
+  if(*ptr >= end)
+    return NULL;
+  int huffman = **ptr & 0x80;
+  if(crest_hpack_integer(ptr, end, 7, &length) != CREST_PARSE_OK)
+    return NULL;
+  if(length > (uint32_t)(end - *ptr))
+    return NULL;
+
+  if(huffman) {
+    string = crest_huffman_decode(*ptr, length, string_length);
+  } else {
+    string = (char *) malloc(length + 1);
+    memcpy(string, *ptr, length);
+    string[length] = 0;
+    *string_length = length;
+  }
+
+  *ptr += length;
+  return string;
+}
+
+void crest_hpack_evict(crest_hpack_table *table, int needed) {
+  while((table->count > 0) && (table->size + needed > table->max_size)) {
+    crest_hpack_entry *entry = &table->entries[(table->first + table->count - 1) % HPACK_MAX_ENTRIES];
+    table->size -= entry->size;
+    free(entry->name);
+    free(entry->value);
+    table->count--;
+  }
+}
+
+// takes ownership of name and value. an entry larger than the
+// whole table empties the table and isn't added
+void crest_hpack_insert(crest_hpack_table *table, char *name, int name_length, char *value, int value_length) {
+  int size = name_length + value_length + HPACK_ENTRY_OVERHEAD;
+  crest_hpack_evict(table, size);
+  if(size > table->max_size) {
+    free(name);
+    free(value);
+    return;
+  }
+
+  table->first = (table->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+  table->entries[table->first].name = name;
+  table->entries[table->first].value = value;
+  table->entries[table->first].name_length = name_length;
+  table->entries[table->first].size = size;
+  table->size += size;
+  table->count++;
+}
+
+// index 1 to 61 refer to the static table, 62 onwards to the
+// dynamic table, newest entry first
+int crest_hpack_lookup(crest_hpack_table *table, uint32_t index, const char **name, int *name_length, const char **value, int *value_length) {
+  if(index == 0)
+    return CREST_PARSE_ERROR;
+
+  if(index <= STATIC_TABLE_LENGTH) {
+    *name = static_table[index - 1].name;
+    *value = static_table[index - 1].value;
+    *name_length = strlen(*name);
+    *value_length = strlen(*value);
+    return CREST_PARSE_OK;
+  }
+
+  index -= STATIC_TABLE_LENGTH + 1;
+  if(index >= (uint32_t) table->count)
+    return CREST_PARSE_ERROR;
+
+  crest_hpack_entry *entry = &table->entries[(table->first + index) % HPACK_MAX_ENTRIES];
+  *name = entry->name;
+  *value = entry->value;
+  *name_length = entry->name_length;
+  *value_length = entry->size - entry->name_length - HPACK_ENTRY_OVERHEAD;
+  return CREST_PARSE_OK;
+}
+
+void crest_hpack_add_header(crest_connection *connection, const char *name, const char *value) {
+  if(connection->request_headers_count >= CREST_MAX_REQUEST_HEADERS) {
+    connection->response_status = 431;
+    return;
+  }
+
+  int new_headers_count = ++connection->request_headers_count;
+  connection->request_header_keys = realloc(connection->request_header_keys, new_headers_count * sizeof(char *));
+  connection->request_header_values = realloc(connection->request_header_values, new_headers_count * sizeof(char *));
+  connection->request_header_keys[new_headers_count - 1] = strdup(name);
+  connection->request_header_values[new_headers_count - 1] = strdup(value);
+}
+
+// a path must be in origin form, and like an HTTP/1.1 request
+// target it can't contain control characters or spaces
+int crest_hpack_valid_path(const char *path) {
+  if(*path != '/')
+    return 0;
+  for(const unsigned char *ptr = (const unsigned char *) path; *ptr; ptr++) {
+    if((*ptr <= ' ') || (*ptr == 127))
+      return 0;
+  }
+  return 1;
+}
+
+// store a decoded header on the connection. pseudo headers set
+// the method and uri; :authority is stored as a host header so
+// handlers see the same headers as they would over HTTP/1.1.
+// malformed requests are answered with 400 rather than routed.
+void crest_hpack_emit(crest_connection *connection, const char *name, int name_length, const char *value, int value_length) {
+  if(!connection)
+    return;
+
+  // names and values are handed to handlers as C strings, so an
+  // embedded NUL would silently truncate them. CR and LF in a
+  // value could split it into two headers if it's ever written
+  // back out over HTTP/1.1
+  if((strlen(name) != (size_t) name_length) || (strlen(value) != (size_t) value_length) || strpbrk(value, "\r\n")) {
+    connection->response_status = 400;
+    return;
+  }
+
+  if(name[0] == ':') {
+    if(strcmp(name, ":method") == 0) {
+      int method;
+      for(method = 0; method < CREST_METHODS_COUNT; method++) {
+        if(strcmp(value, crest_method_names[method]) == 0)
+          break;
+      }
+      if(method == CREST_METHODS_COUNT) {
+        connection->response_status = 400;
+      } else {
+        connection->method = (http_method) method;
+        connection->request_line_parsed = 1;
+      }
+
+    } else if(strcmp(name, ":path") == 0) {
+      if(connection->uri || !crest_hpack_valid_path(value))
+        connection->response_status = 400;
+      else
+        connection->uri = strdup(value);
+
+    } else if(strcmp(name, ":authority") == 0) {
+      crest_hpack_add_header(connection, "host", value);
+
+    } else if(strcmp(name, ":scheme") != 0) {
+      connection->response_status = 400;
+    }
+    return;
+  }
+
+  // HTTP/2 header names must be lower case
+  for(const char *ptr = name; *ptr; ptr++) {
+    if(isupper((unsigned char) *ptr)) {
+      connection->response_status = 400;
+      return;
+    }
+  }
+
+  crest_hpack_add_header(connection, name, value);
+}
+
+
+/*------------------------------------------------------------*/
+/* private encoding functions                                 */
+/*------------------------------------------------------------*/
+unsigned char *crest_hpack_encode_integer(unsigned char *ptr, unsigned char flags, int prefix_bits, uint32_t value) {
+  uint32_t mask = (1U << prefix_bits) - 1;
+  if(value < mask) {
+    *ptr++ = flags | value;
+    return ptr;
+  }
+
+  *ptr++ = flags | mask;
+  value -= mask;
+  while(value >= 128) {
+    *ptr++ = (value & 127) | 128;
+    value >>= 7;
+  }
+  *ptr++ = value;
+  return ptr;
+}
+
+// strings are always sent as plain literals - huffman encoding
+// saves some bytes but costs time on every response
+unsigned char *crest_hpack_encode_string(unsigned char *ptr, const char *string, int lowercase) {
+  int length = strlen(string);
+  ptr = crest_hpack_encode_integer(ptr, 0x00, 7, length);
+  for(int i = 0; i < length; i++)
+    *ptr++ = lowercase ? tolower((unsigned char) string[i]) : string[i];
+  return ptr;
+}
+
+
+/*------------------------------------------------------------*/
+/* hpack functions                                            */
+/*------------------------------------------------------------*/
+crest_hpack_table *crest_hpack_create(void) {
+  if(!huffman_ready)
+    crest_huffman_init();
+
+  crest_hpack_table *table = (crest_hpack_table *) calloc(1, sizeof(crest_hpack_table));
+  table->max_size = CREST_HPACK_TABLE_LENGTH;
+  return table;
+}
+
+void crest_hpack_destroy(crest_hpack_table *table) {
+  table->max_size = 0;
+  crest_hpack_evict(table, 0);
+  free(table);
+}
+
+// decode a complete header block. connection may be NULL, when
+// the block must be decoded to keep the dynamic table in step
+// with the peer but its headers aren't needed (e.g. trailers)
+int crest_hpack_decode(crest_hpack_table *table, unsigned char *block, int length, crest_connection *connection) {
+  unsigned char *ptr = block, *end = block + length;
+  const char *static_name, *static_value;
+  int name_length, value_length;
+  char *name, *value;
+  uint32_t index;
+
+  while(ptr < end) {
+    unsigned char byte = *ptr;
+
+    // indexed header field: 1xxxxxxx
+    if(byte & 0x80) {
+      if(crest_hpack_integer(&ptr, end, 7, &index) != CREST_PARSE_OK)
+        return CREST_PARSE_ERROR;
+      if(crest_hpack_lookup(table, index, &static_name, &name_length, &static_value, &value_length) != CREST_PARSE_OK)
+        return CREST_PARSE_ERROR;
+      crest_hpack_emit(connection, static_name, name_length, static_value, value_length);
+
+    // dynamic table size update: 001xxxxx
+    } else if((byte & 0xe0) == 0x20) {
+      if(crest_hpack_integer(&ptr, end, 5, &index) != CREST_PARSE_OK)
+        return CREST_PARSE_ERROR;
+      if(index > CREST_HPACK_TABLE_LENGTH)
+        return CREST_PARSE_ERROR;
+      table->max_size = index;
+      crest_hpack_evict(table, 0);
+
+    // literal header field with incremental indexing (01xxxxxx),
+    // without indexing (0000xxxx) or never indexed (0001xxxx)
+    } else {
+      int indexing = ((byte & 0xc0) == 0x40);
+      if(crest_hpack_integer(&ptr, end, indexing ? 6 : 4, &index) != CREST_PARSE_OK)
+        return CREST_PARSE_ERROR;
+
+      if(index) {
+        if(crest_hpack_lookup(table, index, &static_name, &name_length, &static_value, &value_length) != CREST_PARSE_OK)
+          return CREST_PARSE_ERROR;
+        name = (char *) malloc(name_length + 1);
+        memcpy(name, static_name, name_length + 1);
+      } else if(!(name = crest_hpack_string(&ptr, end, &name_length))) {
+        return CREST_PARSE_ERROR;
+      }
+
+      if(!(value = crest_hpack_string(&ptr, end, &value_length))) {
+        free(name);
+        return CREST_PARSE_ERROR;
+      }
+
+      crest_hpack_emit(connection, name, name_length, value, value_length);
+      if(indexing) {
+        crest_hpack_insert(table, name, name_length, value, value_length);
+      } else {
+        free(name);
+        free(value);
+      }
+    }
+  }
+
+  return CREST_PARSE_OK;
+}
+
+// encode the response status, content length and headers. no
+// dynamic table is used, so responses never change the state
+// the peer's decoder has to track
+unsigned char *crest_hpack_encode(crest_connection *connection, int *length) {
+  int capacity = 64;
+  char number[16];
+  unsigned char *block, *ptr;
+
+  for(int i = 0; i < connection->response_headers_count; i++)
+    capacity += strlen(connection->response_header_keys[i]) + strlen(connection->response_header_values[i]) + 12;
+  block = ptr = (unsigned char *) malloc(capacity);
+
+  // :status, indexed when the status is in the static table
+  int status_index = 0;
+  for(int index = STATIC_STATUS_INDEX; index < STATIC_STATUS_INDEX + 7; index++) {
+    if(atoi(static_table[index - 1].value) == connection->response_status)
+      status_index = index;
+  }
+
+  if(status_index) {
+    ptr = crest_hpack_encode_integer(ptr, 0x80, 7, status_index);
+  } else {
+    snprintf(number, sizeof(number), "%d", connection->response_status);
+    ptr = crest_hpack_encode_integer(ptr, 0x00, 4, STATIC_STATUS_INDEX);
+    ptr = crest_hpack_encode_string(ptr, number, 0);
+  }
+
+  snprintf(number, sizeof(number), "%d", connection->response_length);
+  ptr = crest_hpack_encode_integer(ptr, 0x00, 4, STATIC_CONTENT_LENGTH_INDEX);
+  ptr = crest_hpack_encode_string(ptr, number, 0);
+
+  for(int i = 0; i < connection->response_headers_count; i++) {
+    *ptr++ = 0x00;
+    ptr = crest_hpack_encode_string(ptr, connection->response_header_keys[i], 1);
+    ptr = crest_hpack_encode_string(ptr, connection->response_header_values[i], 0);
+  }
+
+  *length = ptr - block;
+  return block;
+}
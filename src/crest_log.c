@@ -0,0 +1,299 @@
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "crest.h"
+
+/*------------------------------------------------------------*/
+/* access log state                                           */
+/*------------------------------------------------------------*/
+// requests are formatted by the I/O thread into the current
+// buffer. full buffers (and partial ones older than
+// CREST_LOG_FLUSH_INTERVAL ms) are handed to the writer thread,
+// which writes every pending buffer with a single writev and
+// returns them to the free list. when the writer falls behind
+// and no free buffer is left, the I/O thread waits rather than
+// dropping log lines.
+typedef struct crest_log_buffer {
+  char data[CREST_LOG_BUFFER_LENGTH];
+  int length;
+  struct crest_log_buffer *next;
+} crest_log_buffer;
+
+static crest_log_buffer buffers[CREST_LOG_BUFFERS];
+static crest_log_buffer *current_buffer = NULL;
+static struct timespec current_started;
+
+// free and full buffer lists are shared with the writer thread
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t free_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t full_cond = PTHREAD_COND_INITIALIZER;
+static crest_log_buffer *free_buffers = NULL;
+static crest_log_buffer *full_buffers = NULL;
+static crest_log_buffer **full_buffers_tail = &full_buffers;
+
+// log file, only used by the writer thread once opened
+static char *log_path = NULL;
+static int log_fd = -1;
+static off_t log_length = 0;
+static pthread_t writer;
+
+// formatting the local time is relatively slow, so the
+// formatted time is cached and updated once a second
+static time_t cached_second = 0;
+static char cached_time[32];
+
+// escaped copy of the uri being logged, grown as needed
+static char *escaped_uri = NULL;
+static int escaped_uri_length = 0;
+
+
+/*------------------------------------------------------------*/
+/* private writer functions                                   */
+/*------------------------------------------------------------*/
+// rotated files are named after the time they were closed,
+// e.g: access.log.20260101-120000
+void crest_log_rotate(void) {
+  char rotated_path[4096], suffix[32];
+  time_t now = time(NULL);
+  struct tm local;
+
+  localtime_r(&now, &local);
+  strftime(suffix, sizeof(suffix), "%Y%m%d-%H%M%S", &local);
+  snprintf(rotated_path, sizeof(rotated_path), "%s.%s", log_path, suffix);
+
+  if(rename(log_path, rotated_path) == -1)
+    return;
+
+  // keep appending to the rotated file if a new one can't be opened
+  int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if(fd == -1)
+    return;
+
+  close(log_fd);
+  log_fd = fd;
+  log_length = 0;
+}
+
+void *crest_log_writer(void *argument) {
+  struct iovec parts[CREST_LOG_BUFFERS];
+  crest_log_buffer *pending, *buffer;
+  int count;
+
+  while(1) {
+    pthread_mutex_lock(&log_lock);
+    while(!full_buffers)
+      pthread_cond_wait(&full_cond, &log_lock);
+    pending = full_buffers;
+    full_buffers = NULL;
+    full_buffers_tail = &full_buffers;
+    pthread_mutex_unlock(&log_lock);
+
+    count = 0;
+    for(buffer = pending; buffer; buffer = buffer->next) {
+      parts[count].iov_base = buffer->data;
+      parts[count].iov_len = buffer->length;
+      log_length += buffer->length;
+      count++;
+    }
+
+    crest_write_all(log_fd, parts, count);
+    if(log_length >= CREST_LOG_MAX_FILE_LENGTH)
+      crest_log_rotate();
+
+    // return the written buffers to the free list
+    pthread_mutex_lock(&log_lock);
+    while(pending) {
+      buffer = pending;
+      pending = pending->next;
+      buffer->length = 0;
+      buffer->next = free_buffers;
+      free_buffers = buffer;
+    }
+    pthread_cond_broadcast(&free_cond);
+    pthread_mutex_unlock(&log_lock);
+  }
+
+  return NULL;
+}
+
+
+/*------------------------------------------------------------*/
+/* private buffer functions                                   */
+/*------------------------------------------------------------*/
+void crest_log_submit(void) {
+  current_buffer->next = NULL;
+  pthread_mutex_lock(&log_lock);
+  *full_buffers_tail = current_buffer;
+  full_buffers_tail = &current_buffer->next;
+  pthread_cond_signal(&full_cond);
+  pthread_mutex_unlock(&log_lock);
+  current_buffer = NULL;
+}
+
+void crest_log_take(void) {
+  pthread_mutex_lock(&log_lock);
+  while(!free_buffers)
+    pthread_cond_wait(&free_cond, &log_lock);
+  current_buffer = free_buffers;
+  free_buffers = free_buffers->next;
+  pthread_mutex_unlock(&log_lock);
+  clock_gettime(CLOCK_MONOTONIC, &current_started);
+}
+
+const char *crest_log_time(void) {
+  struct tm local;
+  time_t now = time(NULL);
+  if(now != cached_second) {
+    localtime_r(&now, &local);
+    strftime(cached_time, sizeof(cached_time), "%d/%b/%Y:%H:%M:%S %z", &local);
+    cached_second = now;
+  }
+  return cached_time;
+}
+
+
+// escape uris the way Apache and nginx do: quotes, backslashes
+// and bytes outside printable ASCII are written as \xHH, so a
+// request can't end the quoted request field or start a new line
+const char *crest_log_escape(const char *uri) {
+  int needed = (strlen(uri) * 4) + 1;
+  if(needed > escaped_uri_length) {
+    escaped_uri = (char *) realloc(escaped_uri, needed);
+    escaped_uri_length = needed;
+  }
+
+  char *ptr = escaped_uri;
+  for(const unsigned char *c = (const unsigned char *) uri; *c; c++) {
+    if((*c == '"') || (*c == '\\') || (*c < 0x20) || (*c > 0x7e))
+      ptr += sprintf(ptr, "\\x%02X", *c);
+    else
+      *ptr++ = *c;
+  }
+  *ptr = 0;
+  return escaped_uri;
+}
+
+
+/*------------------------------------------------------------*/
+/* access log functions                                       */
+/*------------------------------------------------------------*/
+// start logging every request to path. must be called before
+// crest_start_server
+int crest_open_log(char *path) {
+  struct stat log_stat;
+
+  log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if(log_fd == -1)
+    return CREST_LOG_ERROR;
+  if(fstat(log_fd, &log_stat) == 0)
+    log_length = log_stat.st_size;
+  log_path = strdup(path);
+
+  for(int i = 0; i < CREST_LOG_BUFFERS; i++) {
+    buffers[i].next = free_buffers;
+    free_buffers = &buffers[i];
+  }
+
+  if(crest_start_thread(&writer, crest_log_writer, NULL)) {
+    close(log_fd);
+    log_fd = -1;
+    return CREST_LOG_ERROR;
+  }
+
+  return CREST_LOG_OK;
+}
+
+// one line per request, in common log format followed by the
+// request duration in microseconds:
+// remote - - [time] "method uri HTTP/major.minor" status bytes duration
+// requests rejected before a valid request line was read are
+// logged with "-" in place of the request
+void crest_log_request(crest_connection *connection) {
+  struct timespec now;
+  long duration;
+  int length;
+
+  if(log_fd == -1)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  duration = ((now.tv_sec - connection->started.tv_sec) * 1000000) + ((now.tv_nsec - connection->started.tv_nsec) / 1000);
+
+  for(int attempt = 0; attempt < 2; attempt++) {
+    if(!current_buffer)
+      crest_log_take();
+
+    int free_bytes = CREST_LOG_BUFFER_LENGTH - current_buffer->length;
+    if(connection->request_line_parsed) {
+      length = snprintf(current_buffer->data + current_buffer->length, free_bytes,
+        "%s - - [%s] \"%s %s HTTP/%d.%d\" %d %d %ld\n",
+        connection->remote_address ? connection->remote_address : "-",
+        crest_log_time(), crest_method_names[connection->method], crest_log_escape(connection->uri),
+        connection->http_major_version, connection->http_minor_version,
+        connection->response_status, connection->response_length, duration);
+    } else {
+      length = snprintf(current_buffer->data + current_buffer->length, free_bytes,
+        "%s - - [%s] \"-\" %d %d %ld\n",
+        connection->remote_address ? connection->remote_address : "-",
+        crest_log_time(), connection->response_status, connection->response_length, duration);
+    }
+
+    if(length < free_bytes) {
+      current_buffer->length += length;
+      break;
+    }
+
+    // the line didn't fit. hand off the buffer and retry with an
+    // empty one, unless it was already empty, in which case the
+    // line is truncated to the buffer length
+    if(current_buffer->length == 0) {
+      current_buffer->length = CREST_LOG_BUFFER_LENGTH;
+      current_buffer->data[CREST_LOG_BUFFER_LENGTH - 1] = '\n';
+      break;
+    }
+    crest_log_submit();
+  }
+}
+
+// called by the I/O loop so quiet servers still write log lines
+// within CREST_LOG_FLUSH_INTERVAL ms
+void crest_log_check(void) {
+  struct timespec now;
+  long elapsed;
+
+  if(!current_buffer || (current_buffer->length == 0))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = ((now.tv_sec - current_started.tv_sec) * 1000) + ((now.tv_nsec - current_started.tv_nsec) / 1000000);
+  if(elapsed >= CREST_LOG_FLUSH_INTERVAL)
+    crest_log_submit();
+}
+
+// hand off the current buffer and wait until every buffered line
+// has been written. called by the I/O loop as the server stops
+void crest_log_flush(void) {
+  crest_log_buffer *buffer;
+  int free_count;
+
+  if(log_fd == -1)
+    return;
+  if(current_buffer)
+    crest_log_submit();
+
+  pthread_mutex_lock(&log_lock);
+  while(1) {
+    free_count = 0;
+    for(buffer = free_buffers; buffer; buffer = buffer->next)
+      free_count++;
+    if(free_count == CREST_LOG_BUFFERS)
+      break;
+    pthread_cond_wait(&free_cond, &log_lock);
+  }
+  pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,211 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "crest.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+/*------------------------------------------------------------*/
+/* offload pool state                                         */
+/*------------------------------------------------------------*/
+// handlers flagged with @offload in the routes file are run
+// on a small pool of threads instead of the I/O thread. each
+// pool thread owns a bounded queue of jobs; the I/O thread
+// submits to the queues round robin, and a thread with an
+// empty queue steals from the others before going to sleep.
+typedef struct {
+  crest_handler handler;
+  crest_connection *connection;
+} crest_job;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_t thread;
+  crest_job jobs[CREST_OFFLOAD_QUEUE_LENGTH];
+  int head;
+  int count;
+  int index;
+} crest_offload_queue;
+
+static crest_offload_queue queues[CREST_OFFLOAD_THREADS];
+static int next_queue = 0;
+
+// idle threads sleep on idle_cond until pending_jobs is non
+// zero. pending_jobs is only a hint - a woken thread may find
+// every queue empty if another thread got there first.
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int pending_jobs = 0;
+
+// completed connections are pushed onto a lock free stack by
+// the pool threads, and taken all at once by the I/O thread.
+// the I/O thread is woken through wakeup_write_fd whenever the
+// stack goes from empty to non empty.
+static crest_connection *completed = NULL;
+static int wakeup_read_fd = -1;
+static int wakeup_write_fd = -1;
+
+
+/*------------------------------------------------------------*/
+/* private queue functions                                    */
+/*------------------------------------------------------------*/
+int crest_offload_push(crest_offload_queue *queue, crest_handler handler, crest_connection *connection) {
+  int pushed = 0;
+  pthread_mutex_lock(&queue->lock);
+  if(queue->count < CREST_OFFLOAD_QUEUE_LENGTH) {
+    crest_job *job = &queue->jobs[(queue->head + queue->count) % CREST_OFFLOAD_QUEUE_LENGTH];
+    job->handler = handler;
+    job->connection = connection;
+    queue->count++;
+    pushed = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return pushed;
+}
+
+int crest_offload_pop(crest_offload_queue *queue, crest_job *job) {
+  int popped = 0;
+  pthread_mutex_lock(&queue->lock);
+  if(queue->count > 0) {
+    *job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % CREST_OFFLOAD_QUEUE_LENGTH;
+    queue->count--;
+    popped = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return popped;
+}
+
+// take the oldest job from this thread's own queue, falling
+// back to stealing the oldest job from each other queue in turn
+int crest_offload_take(crest_offload_queue *queue, crest_job *job) {
+  for(int i = 0; i < CREST_OFFLOAD_THREADS; i++) {
+    if(crest_offload_pop(&queues[(queue->index + i) % CREST_OFFLOAD_THREADS], job)) {
+      __atomic_sub_fetch(&pending_jobs, 1, __ATOMIC_RELAXED);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void crest_offload_wakeup(void) {
+  uint64_t value = 1;
+  write(wakeup_write_fd, &value, sizeof(value));
+}
+
+void *crest_offload_thread(void *argument) {
+  crest_offload_queue *queue = (crest_offload_queue *) argument;
+  crest_job job;
+
+  while(1) {
+    if(!crest_offload_take(queue, &job)) {
+      pthread_mutex_lock(&idle_lock);
+      while(__atomic_load_n(&pending_jobs, __ATOMIC_RELAXED) == 0)
+        pthread_cond_wait(&idle_cond, &idle_lock);
+      pthread_mutex_unlock(&idle_lock);
+      continue;
+    }
+
+    job.handler(job.connection);
+    crest_trace(job.connection, crest_phase_handled);
+
+    // hand the connection back to the I/O thread, only waking
+    // it if the stack was empty (otherwise a wakeup is pending)
+    crest_connection *head = __atomic_load_n(&completed, __ATOMIC_RELAXED);
+    do {
+      job.connection->next_completed = head;
+    } while(!__atomic_compare_exchange_n(&completed, &head, job.connection, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if(head == NULL)
+      crest_offload_wakeup();
+  }
+
+  return NULL;
+}
+
+
+/*------------------------------------------------------------*/
+/* offload pool functions                                     */
+/*------------------------------------------------------------*/
+// start the pool threads, returning a descriptor the I/O thread
+// should poll for readability, or -1 with errno set on failure
+int crest_offload_start(void) {
+#ifdef __linux__
+  wakeup_read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(wakeup_read_fd == -1)
+    return -1;
+  wakeup_write_fd = wakeup_read_fd;
+#else
+  int fds[2];
+  if(pipe(fds) == -1)
+    return -1;
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  wakeup_read_fd = fds[0];
+  wakeup_write_fd = fds[1];
+#endif
+
+  for(int i = 0; i < CREST_OFFLOAD_THREADS; i++) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    queues[i].index = i;
+    // pthread errors are returned rather than set in errno
+    int error = crest_start_thread(&queues[i].thread, crest_offload_thread, &queues[i]);
+    if(error) {
+      errno = error;
+      return -1;
+    }
+  }
+
+  return wakeup_read_fd;
+}
+
+// returns the list of connections whose handlers have returned
+// since the last call, oldest first, linked by next_completed
+crest_connection *crest_offload_completed(void) {
+  uint64_t value;
+  crest_connection *connection, *next, *reversed = NULL;
+
+  // the wakeup must be consumed before taking the stack, so a
+  // push racing with this call always leaves a wakeup behind
+  while(read(wakeup_read_fd, &value, sizeof(value)) > 0);
+  connection = __atomic_exchange_n(&completed, NULL, __ATOMIC_ACQUIRE);
+
+  while(connection) {
+    next = connection->next_completed;
+    connection->next_completed = reversed;
+    reversed = connection;
+    connection = next;
+  }
+
+  return reversed;
+}
+
+// called from generated match_url code for @offload routes. if
+// every queue is full the connection is left with a 503 status
+// and completed by the I/O thread as normal
+void crest_offload(crest_handler handler, crest_connection *connection) {
+  // the connection belongs to the pool thread as soon as it's
+  // pushed, so mark it before rather than after
+  connection->offloaded = 1;
+
+  for(int i = 0; i < CREST_OFFLOAD_THREADS; i++) {
+    crest_offload_queue *queue = &queues[next_queue];
+    next_queue = (next_queue + 1) % CREST_OFFLOAD_THREADS;
+
+    if(crest_offload_push(queue, handler, connection)) {
+      pthread_mutex_lock(&idle_lock);
+      __atomic_add_fetch(&pending_jobs, 1, __ATOMIC_RELAXED);
+      pthread_cond_signal(&idle_cond);
+      pthread_mutex_unlock(&idle_lock);
+      return;
+    }
+  }
+
+  connection->offloaded = 0;
+  connection->response_status = 503;
+}
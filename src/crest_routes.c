@@ -0,0 +1,275 @@
+#ifdef __linux__
+#define _GNU_SOURCE   // memfd_create
+#endif
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include "crest.h"
+
+// match_url is only present when a generated routes file is
+// linked into the binary; servers that load every route table
+// with crest_load_routes leave it undefined
+#pragma weak match_url
+
+#define COPY_PATH_LENGTH      4096
+#define COPY_BUFFER_LENGTH    (64 * 1024)
+
+/*------------------------------------------------------------*/
+/* route table state                                          */
+/*------------------------------------------------------------*/
+// every request holds a reference to the table it was matched
+// against until the connection is freed, as offloaded handlers
+// may still be running code from that table. when a new table
+// is loaded the old one is retired, and only closed once its
+// last in-flight request has finished. tables are only loaded,
+// referenced and released on the I/O thread, so switching
+// tables between requests needs no further synchronisation.
+typedef struct crest_routes {
+  void *handle;
+  int copy;   // memfd the table was loaded from, or -1
+  int (*match_url)(char *url, crest_connection *connection);
+  unsigned long version;
+  int requests;
+  struct crest_routes *next_retired;
+} crest_routes;
+
+static crest_routes static_routes = {NULL, -1, match_url, 0, 0, NULL};
+static crest_routes *current_routes = &static_routes;
+static crest_routes *retired_routes = NULL;
+
+// the route file is checked for changes at most once every
+// CREST_ROUTES_CHECK_INTERVAL ms, or immediately after SIGHUP
+static char *routes_path = NULL;
+static struct stat routes_stat;
+static struct timespec last_check;
+static volatile sig_atomic_t reload_requested = 0;
+
+
+/*------------------------------------------------------------*/
+/* private route table functions                              */
+/*------------------------------------------------------------*/
+void crest_routes_sighup(int signal) {
+  reload_requested = 1;
+}
+
+// dlopen returns the already loaded object when given a path it
+// has seen before, so each table is opened from a private copy.
+// the copy also protects the running table from being
+// overwritten in place while a new one is written. on Linux the
+// copy is a memfd loaded through /proc/self/fd, so loading doesn't
+// depend on /tmp allowing execution. the memfd stays open while
+// the table is loaded, so no two loaded tables share a path.
+// elsewhere the copy is written next to the table, on the same
+// filesystem, and unlinked once loaded
+int crest_routes_create_copy(char *path, char *copy_path, int *anonymous) {
+#ifdef __linux__
+  int fd = memfd_create("crest_routes", MFD_CLOEXEC);
+  if(fd != -1) {
+    snprintf(copy_path, COPY_PATH_LENGTH, "/proc/self/fd/%d", fd);
+    *anonymous = 1;
+    return fd;
+  }
+#endif
+  *anonymous = 0;
+  snprintf(copy_path, COPY_PATH_LENGTH, "%s.XXXXXX", path);
+  return mkstemp(copy_path);
+}
+
+int crest_routes_copy(char *path, int output) {
+  char buffer[COPY_BUFFER_LENGTH];
+  int input, length, status = CREST_LOAD_OK;
+
+  input = open(path, O_RDONLY);
+  if(input == -1)
+    return CREST_LOAD_ERROR;
+
+  while((length = read(input, buffer, COPY_BUFFER_LENGTH)) > 0) {
+    if(write(output, buffer, length) != length) {
+      status = CREST_LOAD_ERROR;
+      break;
+    }
+  }
+
+  if(length == -1)
+    status = CREST_LOAD_ERROR;
+
+  close(input);
+  return status;
+}
+
+crest_routes *crest_routes_open(char *path) {
+  char copy_path[COPY_PATH_LENGTH];
+  unsigned long *version;
+  void *handle = NULL;
+  int copy, anonymous;
+
+  copy = crest_routes_create_copy(path, copy_path, &anonymous);
+  if((copy == -1) || (crest_routes_copy(path, copy) != CREST_LOAD_OK)) {
+    fprintf(stderr, "crest: unable to read route table %s\n", path);
+  } else {
+    handle = dlopen(copy_path, RTLD_NOW | RTLD_LOCAL);
+    if(!handle)
+      fprintf(stderr, "crest: unable to load route table %s: %s\n", path, dlerror());
+  }
+
+  // file copies are only needed until they're mapped
+  if((copy != -1) && !anonymous) {
+    unlink(copy_path);
+    close(copy);
+    copy = -1;
+  }
+
+  if(!handle) {
+    if(copy != -1)
+      close(copy);
+    return NULL;
+  }
+
+  crest_routes *routes = (crest_routes *) calloc(1, sizeof(crest_routes));
+  routes->handle = handle;
+  routes->copy = copy;
+  routes->match_url = (int (*)(char *, crest_connection *)) dlsym(handle, "match_url");
+  if(!routes->match_url) {
+    fprintf(stderr, "crest: route table %s does not export match_url\n", path);
+    dlclose(handle);
+    if(copy != -1)
+      close(copy);
+    free(routes);
+    return NULL;
+  }
+
+  version = (unsigned long *) dlsym(handle, "crest_routes_version");
+  if(version)
+    routes->version = *version;
+
+  return routes;
+}
+
+// close every retired table that has no requests in flight
+void crest_routes_collect(void) {
+  crest_routes **link = &retired_routes, *routes;
+  while(*link) {
+    routes = *link;
+    if(routes->requests == 0) {
+      *link = routes->next_retired;
+      dlclose(routes->handle);
+      if(routes->copy != -1)
+        close(routes->copy);
+      free(routes);
+    } else {
+      link = &routes->next_retired;
+    }
+  }
+}
+
+void crest_routes_publish(crest_routes *routes) {
+  crest_routes *old_routes = current_routes;
+  current_routes = routes;
+  fprintf(stderr, "crest: loaded route table version %lx from %s\n", routes->version, routes_path);
+
+  if(old_routes != &static_routes) {
+    old_routes->next_retired = retired_routes;
+    retired_routes = old_routes;
+    crest_routes_collect();
+  }
+}
+
+
+/*------------------------------------------------------------*/
+/* route table functions                                      */
+/*------------------------------------------------------------*/
+// load a route table built from crestgen -shared output. the
+// table replaces any linked in match_url, and is reloaded when
+// the file changes or the server receives SIGHUP
+int crest_load_routes(char *path) {
+  struct sigaction action;
+  struct stat path_stat;
+
+  if(stat(path, &path_stat) == -1) {
+    fprintf(stderr, "crest: unable to read route table %s\n", path);
+    return CREST_LOAD_ERROR;
+  }
+
+  crest_routes *routes = crest_routes_open(path);
+  if(!routes)
+    return CREST_LOAD_ERROR;
+
+  free(routes_path);
+  routes_path = strdup(path);
+  routes_stat = path_stat;
+  clock_gettime(CLOCK_MONOTONIC, &last_check);
+  crest_routes_publish(routes);
+
+  // SA_RESTART isn't set, and threads started by the server block
+  // SIGHUP, so the signal always interrupts poll in the I/O loop
+  // and the reload happens straight away
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = crest_routes_sighup;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGHUP, &action, NULL);
+
+  return CREST_LOAD_OK;
+}
+
+// called by the I/O loop between requests to pick up a new table
+void crest_routes_check(void) {
+  struct stat path_stat;
+  struct timespec now;
+  long elapsed;
+
+  if(!routes_path)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = ((now.tv_sec - last_check.tv_sec) * 1000) + ((now.tv_nsec - last_check.tv_nsec) / 1000000);
+  if(!reload_requested && (elapsed < CREST_ROUTES_CHECK_INTERVAL))
+    return;
+  last_check = now;
+
+  if(stat(routes_path, &path_stat) == -1)
+    return;
+
+  int changed = (path_stat.st_ino != routes_stat.st_ino) ||
+                (path_stat.st_size != routes_stat.st_size) ||
+                (path_stat.st_mtime != routes_stat.st_mtime);
+  if(!reload_requested && !changed)
+    return;
+
+  // a table that fails to load (e.g. one that is still being
+  // written) leaves the current table in place
+  reload_requested = 0;
+  routes_stat = path_stat;
+  crest_routes *routes = crest_routes_open(routes_path);
+  if(routes)
+    crest_routes_publish(routes);
+}
+
+// match the connection's uri against the current table, holding
+// a reference to the table until crest_routes_release
+int crest_route(crest_connection *connection) {
+  crest_routes *routes = current_routes;
+  if(!routes->match_url)
+    return 0;
+
+  routes->requests++;
+  connection->routes = routes;
+  return routes->match_url(connection->uri, connection);
+}
+
+void crest_routes_release(crest_connection *connection) {
+  crest_routes *routes = (crest_routes *) connection->routes;
+  if(!routes)
+    return;
+
+  connection->routes = NULL;
+  routes->requests--;
+  if((routes->requests == 0) && (routes != current_routes) && (routes != &static_routes))
+    crest_routes_collect();
+}
@@ -0,0 +1,64 @@
+#ifdef CREST_TRACE
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include "crest.h"
+
+/*------------------------------------------------------------*/
+/* trace ring state                                           */
+/*------------------------------------------------------------*/
+// records are only written by the I/O thread that finishes the
+// request, so the ring has a single writer and needs no locks.
+// readers detect records overwritten mid-read by comparing the
+// record's sequence number before and after copying it.
+static crest_trace_ring *ring = NULL;
+
+
+/*------------------------------------------------------------*/
+/* trace functions                                            */
+/*------------------------------------------------------------*/
+int crest_trace_open(void) {
+  size_t length = sizeof(crest_trace_ring) + (CREST_TRACE_RECORDS * sizeof(crest_trace_record));
+  int fd = open(CREST_TRACE_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1)
+    return -1;
+
+  if(ftruncate(fd, length) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  ring = (crest_trace_ring *) mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(ring == MAP_FAILED) {
+    ring = NULL;
+    return -1;
+  }
+
+  ring->record_count = CREST_TRACE_RECORDS;
+  ring->worker = 0;
+  __atomic_store_n(&ring->magic, CREST_TRACE_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void crest_trace_commit(crest_connection *connection) {
+  if(!ring)
+    return;
+
+  uint64_t index = ring->head;
+  crest_trace_record *record = &ring->records[index % CREST_TRACE_RECORDS];
+
+  __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(record->phases, connection->trace, sizeof(record->phases));
+  record->status = connection->response_status;
+  record->offloaded = connection->offloaded;
+  strncpy(record->uri, connection->uri ? connection->uri : "", CREST_TRACE_URI_LENGTH - 1);
+  record->uri[CREST_TRACE_URI_LENGTH - 1] = 0;
+
+  __atomic_store_n(&record->sequence, index + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->head, index + 1, __ATOMIC_RELEASE);
+}
+#endif
@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -35,6 +36,7 @@ typedef struct {
   int transitions_count;
   int non_null_transitions_count;
   char *function_name;
+  int offload;
   int index;
 } state;
 
@@ -51,6 +53,30 @@ static int routes_count = 0;
 // show_book GET /books/:id
 // delete_book DELETE /books/:id
 
+// routes may be followed by flags, e.g:
+// resize_image /images/resize @offload
+// @offload runs the route's function on the offload pool
+// rather than the I/O thread, for blocking or slow handlers
+void parse_flags(char *line, char *end_line, state *end_state, int line_number) {
+  while(line < end_line) {
+    while((line < end_line) && isspace(*line))
+      line++;
+    if(line == end_line)
+      break;
+    
+    char *flag = line;
+    while((line < end_line) && !isspace(*line))
+      line++;
+    
+    if(((line - flag) == 8) && (strncmp(flag, "@offload", 8) == 0)) {
+      end_state->offload = 1;
+    } else {
+      printf("Error: Unknown route flag '%.*s' on line #%d\n", (int)(line - flag), flag, line_number);
+      exit(1);
+    }
+  }
+}
+
 void parse_line(char *line, char *end_line, int line_number) {
   // start and end states of the transition
   state *start_state, *end_state, *previous_state, *current_state;
@@ -110,6 +136,7 @@ void parse_line(char *line, char *end_line, int line_number) {
     line++;
   }
   
+  parse_flags(line, end_line, end_state, line_number);
   start_states[routes_count] = start_state;
   end_states[routes_count] = end_state;
   routes_count++;
@@ -178,9 +205,21 @@ void switch_for_state(state *current_state) {
   if(current_state->index != 0)
     printf("\tstate%d:\n", current_state->index);
   
+  // intermediate states are only reached by matching a character,
+  // so step past it before testing the next one
+  if(current_state->type == intermediate)
+    printf("\turl++;\n");
+  
   // at an end point, call the function corresponding to a matched url
+  // crest_trace expands to nothing unless built with CREST_TRACE
   if(current_state->type == end_point) {
-    printf("\t%s(connection);\n\treturn 1;\n\n", current_state->function_name);
+    printf("\tcrest_trace(connection, crest_phase_routed);\n");
+    if(current_state->offload) {
+      printf("\tcrest_offload(%s, connection);\n\treturn 1;\n\n", current_state->function_name);
+    } else {
+      printf("\t%s(connection);\n", current_state->function_name);
+      printf("\tcrest_trace(connection, crest_phase_handled);\n\treturn 1;\n\n");
+    }
     
   } else if(current_state->type == intermediate || current_state->type == start_point) {
     // for a single transition from a state, use an if statement
@@ -219,10 +258,15 @@ void switch_for_state(state *current_state) {
   }
 }
 
-void generate_code(state *start) {
+// when generating a shared route table, crest_routes_version is
+// exported alongside match_url so the server can report which
+// table it has loaded
+void generate_code(state *start, int shared, unsigned long version) {
   printf("#include \"crest.h\"\n\n");
   for(int i = 0; i < routes_count; i++)
     printf("extern void %s(crest_connection *connection);\n", end_states[i]->function_name);
+  if(shared)
+    printf("\nunsigned long crest_routes_version = 0x%lxUL;\n", version);
   printf("\nint match_url(char *url, crest_connection *connection) {\n");
   switch_for_state(start);
   printf("}\n");
@@ -232,9 +276,23 @@ void generate_code(state *start) {
 /*------------------------------------------------------------*/
 /* main                                                       */
 /*------------------------------------------------------------*/
+// FNV-1a hash of the routes file, used as the route table version
+unsigned long hash_data(char *data, int length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for(int i = 0; i < length; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
 int main(int argc, char **argv) {
-  if(argc < 2) {
-    printf("Usage:\t%s input_path\n", argv[0]);
+  int shared = (argc > 2) && (strcmp(argv[1], "-shared") == 0);
+  char *input_path = argv[shared ? 2 : 1];
+  
+  if((argc < 2) || (argc > 3) || ((argc == 3) && !shared)) {
+    printf("Usage:\t%s [-shared] input_path\n", argv[0]);
+    printf("\t-shared: generate a route table to build as a shared object\n");
     printf("\tinput_path: crest route file path\n");
     exit(0);
   }
@@ -242,7 +300,7 @@ int main(int argc, char **argv) {
   // open the input file and determine file length to
   // create a buffer before reading
   // TODO: handle file open error
-  FILE *file = fopen(argv[1], "rb");
+  FILE *file = fopen(input_path, "rb");
   fseek(file, 0, SEEK_END);
   int file_length = ftell(file);
   rewind(file);
@@ -257,6 +315,7 @@ int main(int argc, char **argv) {
   data[file_length] = 0;
   fread(data, 1, file_length, file);
   fclose(file);
+  unsigned long version = hash_data(data, file_length);
   
   // the parse_line function reads the next line from
   // data and returns a new start state representing
@@ -304,7 +363,7 @@ int main(int argc, char **argv) {
   }
   
   collapse(start_state);
-  generate_code(start_state);
+  generate_code(start_state, shared, version);
   
   return 0;
 }
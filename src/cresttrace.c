@@ -0,0 +1,211 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "crest.h"
+
+/*------------------------------------------------------------*/
+/* request spans                                              */
+/*------------------------------------------------------------*/
+// each span covers the time between two consecutive phases.
+// spans are skipped when either phase wasn't recorded, e.g. the
+// route and handler spans of a request that matched no route, or
+// when they end before they start, e.g. the write span of a
+// handler that called crest_complete itself.
+#define SPAN_COUNT  (crest_phase_count - 1)
+
+static const char *span_names[SPAN_COUNT] = {
+  "wait",           // accept -> first byte
+  "request line",   // first byte -> request line parsed
+  "headers",        // request line parsed -> headers parsed
+  "route",          // headers parsed -> route matched
+  "handler",        // route matched -> handler returned
+  "write"           // handler returned -> response written
+};
+
+int span_valid(crest_trace_record *record, int span) {
+  return record->phases[span] && record->phases[span + 1] && (record->phases[span + 1] >= record->phases[span]);
+}
+
+uint64_t span_length(crest_trace_record *record, int span) {
+  return record->phases[span + 1] - record->phases[span];
+}
+
+
+/*------------------------------------------------------------*/
+/* trace file reader                                          */
+/*------------------------------------------------------------*/
+// copy the records still present in the ring, skipping any that
+// the server overwrote while they were being read
+crest_trace_record *read_records(char *path, int *count) {
+  struct stat file_stat;
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    printf("Error: unable to open trace file %s\n", path);
+    exit(1);
+  }
+
+  fstat(fd, &file_stat);
+  if(file_stat.st_size < sizeof(crest_trace_ring)) {
+    printf("Error: %s is not a crest trace file\n", path);
+    exit(1);
+  }
+
+  crest_trace_ring *ring = (crest_trace_ring *) mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if((ring == MAP_FAILED) || (ring->magic != CREST_TRACE_MAGIC) ||
+     (file_stat.st_size < sizeof(crest_trace_ring) + ((size_t) ring->record_count * sizeof(crest_trace_record)))) {
+    printf("Error: %s is not a crest trace file\n", path);
+    exit(1);
+  }
+
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t first = (head > ring->record_count) ? head - ring->record_count : 0;
+  crest_trace_record *records = (crest_trace_record *) malloc((head - first + 1) * sizeof(crest_trace_record));
+  *count = 0;
+
+  for(uint64_t index = first; index < head; index++) {
+    crest_trace_record *record = &ring->records[index % ring->record_count];
+    uint64_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+    memcpy(&records[*count], record, sizeof(crest_trace_record));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if((sequence == index + 1) && (__atomic_load_n(&record->sequence, __ATOMIC_RELAXED) == sequence))
+      (*count)++;
+  }
+
+  return records;
+}
+
+
+/*------------------------------------------------------------*/
+/* output generators                                          */
+/*------------------------------------------------------------*/
+void print_json_string(char *string) {
+  putchar('"');
+  for(; *string; string++) {
+    if((*string == '"') || (*string == '\\'))
+      printf("\\%c", *string);
+    else if((unsigned char) *string < 32)
+      printf("\\u%04x", *string);
+    else
+      putchar(*string);
+  }
+  putchar('"');
+}
+
+// chrome://tracing and Perfetto format. offloaded requests are
+// shown on a separate row as they overlap the I/O thread's work
+void print_chrome(crest_trace_record *records, int count) {
+  uint64_t origin = 0;
+  int first = 1;
+
+  // records are in completion order, so the earliest accepted
+  // request may be anywhere in the ring
+  for(int i = 0; i < count; i++) {
+    uint64_t accepted = records[i].phases[crest_phase_accept];
+    if(accepted && (!origin || (accepted < origin)))
+      origin = accepted;
+  }
+
+  printf("{\"traceEvents\":[\n");
+  for(int i = 0; i < count; i++) {
+    crest_trace_record *record = &records[i];
+    int tid = record->offloaded ? 2 : 1;
+
+    printf("%s{\"name\":", first ? "" : ",\n");
+    print_json_string(record->uri);
+    printf(",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"status\":%d}}",
+      tid, (record->phases[crest_phase_accept] - origin) / 1000.0,
+      (record->phases[crest_phase_complete] - record->phases[crest_phase_accept]) / 1000.0,
+      record->status);
+    first = 0;
+
+    for(int span = 0; span < SPAN_COUNT; span++) {
+      if(!span_valid(record, span))
+        continue;
+      printf(",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+        span_names[span], tid, (record->phases[span] - origin) / 1000.0,
+        span_length(record, span) / 1000.0);
+    }
+  }
+  printf("\n]}\n");
+}
+
+int compare_lengths(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+void print_summary_line(const char *name, uint64_t *lengths, int count) {
+  if(count == 0) {
+    printf("%-14s %8d\n", name, 0);
+    return;
+  }
+
+  qsort(lengths, count, sizeof(uint64_t), compare_lengths);
+  printf("%-14s %8d %12.1f %12.1f %12.1f\n", name, count,
+    lengths[count / 2] / 1000.0,
+    lengths[(count * 99) / 100] / 1000.0,
+    lengths[count - 1] / 1000.0);
+}
+
+// per span latency percentiles, in microseconds
+void print_summary(crest_trace_record *records, int count) {
+  uint64_t *lengths = (uint64_t *) malloc((count + 1) * sizeof(uint64_t));
+  int lengths_count;
+
+  printf("%-14s %8s %12s %12s %12s\n", "span", "count", "p50 us", "p99 us", "max us");
+  for(int span = 0; span < SPAN_COUNT; span++) {
+    lengths_count = 0;
+    for(int i = 0; i < count; i++) {
+      if(span_valid(&records[i], span))
+        lengths[lengths_count++] = span_length(&records[i], span);
+    }
+    print_summary_line(span_names[span], lengths, lengths_count);
+  }
+
+  lengths_count = 0;
+  for(int i = 0; i < count; i++) {
+    if(records[i].phases[crest_phase_accept] && records[i].phases[crest_phase_complete])
+      lengths[lengths_count++] = records[i].phases[crest_phase_complete] - records[i].phases[crest_phase_accept];
+  }
+  print_summary_line("total", lengths, lengths_count);
+  free(lengths);
+}
+
+
+/*------------------------------------------------------------*/
+/* main                                                       */
+/*------------------------------------------------------------*/
+int main(int argc, char **argv) {
+  char *path = CREST_TRACE_FILE;
+  int chrome = 0, count;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "-chrome") == 0) {
+      chrome = 1;
+    } else if(strcmp(argv[i], "-summary") == 0) {
+      chrome = 0;
+    } else if(argv[i][0] == '-') {
+      printf("Usage:\t%s [-chrome | -summary] [trace_path]\n", argv[0]);
+      printf("\t-chrome: print the trace as Chrome trace event JSON\n");
+      printf("\t-summary: print latency percentiles for each phase (default)\n");
+      printf("\ttrace_path: trace file written by the server (default %s)\n", CREST_TRACE_FILE);
+      exit(0);
+    } else {
+      path = argv[i];
+    }
+  }
+
+  crest_trace_record *records = read_records(path, &count);
+  if(chrome)
+    print_chrome(records, count);
+  else
+    print_summary(records, count);
+
+  return 0;
+}
@@ -0,0 +1,21 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "crest.h"
+
+void route_1(crest_connection *connection) {
+  printf("Route 1\n");
+}
+
+void route_2(crest_connection *connection) {
+  printf("Route 2\n");
+}
+
+void route_3(crest_connection *connection) {
+  printf("Route 3\n");
+}
+
+// offloaded in test/routes, so sleeping doesn't block other routes
+void route_4(crest_connection *connection) {
+  sleep(1);
+  crest_write_string(connection, "Route 4\n");
+}
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "crest.h"
+
+// decodes the header block examples from RFC 7541 appendix C, and
+// checks both the headers stored on the connection and the state
+// of the dynamic table after each block. exits with 1 if any
+// check fails. usage: test_hpack
+
+// private to crest_hpack.c. entries 62 onwards are the dynamic
+// table, newest first
+int crest_hpack_lookup(crest_hpack_table *table, uint32_t index, const char **name, int *name_length, const char **value, int *value_length);
+
+typedef struct {
+  const char *name;
+  const char *value;
+} header;
+
+static int failures = 0;
+
+#define check(condition, ...) do { \
+  if(!(condition)) { \
+    printf("FAIL %s: ", name); \
+    printf(__VA_ARGS__); \
+    printf("\n"); \
+    failures++; \
+  } \
+} while(0)
+
+
+/*------------------------------------------------------------*/
+/* helpers                                                    */
+/*------------------------------------------------------------*/
+// convert a hex string, ignoring spaces, to bytes
+int unhex(const char *hex, unsigned char *output) {
+  int length = 0;
+  for(; *hex; hex++) {
+    if(*hex == ' ')
+      continue;
+    sscanf(hex, "%2hhx", &output[length++]);
+    hex++;
+  }
+  return length;
+}
+
+crest_connection *decode(const char *name, crest_hpack_table *table, const char *hex) {
+  unsigned char block[1024];
+  int length = unhex(hex, block);
+  crest_connection *connection = (crest_connection *) calloc(1, sizeof(crest_connection));
+  connection->client = -1;
+  check(crest_hpack_decode(table, block, length, connection) == CREST_PARSE_OK, "block not decoded");
+  return connection;
+}
+
+// the headers stored on the connection, other than those set
+// from pseudo headers, in the order they were decoded
+void check_headers(const char *name, crest_connection *connection, const header *expected, int count) {
+  check(connection->request_headers_count == count, "%d headers, expected %d", connection->request_headers_count, count);
+  for(int i = 0; (i < count) && (i < connection->request_headers_count); i++) {
+    check(strcmp(connection->request_header_keys[i], expected[i].name) == 0, "header %d is %s, expected %s", i, connection->request_header_keys[i], expected[i].name);
+    check(strcmp(connection->request_header_values[i], expected[i].value) == 0, "header %d is %s, expected %s", i, connection->request_header_values[i], expected[i].value);
+  }
+}
+
+void check_request(const char *name, crest_connection *connection, const char *uri) {
+  check(connection->response_status == 0, "status %d", connection->response_status);
+  check(connection->method == http_get, "method %d", connection->method);
+  check(connection->uri && (strcmp(connection->uri, uri) == 0), "uri %s, expected %s", connection->uri, uri);
+}
+
+// entries newest first, and the table size including the 32
+// byte overhead of each entry
+void check_table(const char *name, crest_hpack_table *table, const header *expected, int count, int size) {
+  const char *entry_name, *entry_value;
+  int name_length, value_length, total = 0;
+
+  for(int i = 0; i < count; i++) {
+    if(crest_hpack_lookup(table, 62 + i, &entry_name, &name_length, &entry_value, &value_length) != CREST_PARSE_OK) {
+      check(0, "table has %d entries, expected %d", i, count);
+      return;
+    }
+    check(strcmp(entry_name, expected[i].name) == 0, "entry %d is %s, expected %s", i, entry_name, expected[i].name);
+    check(strcmp(entry_value, expected[i].value) == 0, "entry %d is %s, expected %s", i, entry_value, expected[i].value);
+    total += name_length + value_length + 32;
+  }
+
+  check(crest_hpack_lookup(table, 62 + count, &entry_name, &name_length, &entry_value, &value_length) != CREST_PARSE_OK, "table has more than %d entries", count);
+  check(total == size, "table size %d, expected %d", total, size);
+}
+
+void check_invalid(const char *name, const char *hex) {
+  unsigned char block[64];
+  int length = unhex(hex, block);
+  crest_hpack_table *table = crest_hpack_create();
+  check(crest_hpack_decode(table, block, length, NULL) == CREST_PARSE_ERROR, "block decoded");
+  crest_hpack_destroy(table);
+}
+
+
+/*------------------------------------------------------------*/
+/* request examples (C.3 without huffman coding, C.4 with)    */
+/*------------------------------------------------------------*/
+static const header request_1_headers[] = {
+  {"host", "www.example.com"}
+};
+static const header request_1_table[] = {
+  {":authority", "www.example.com"}
+};
+
+static const header request_2_headers[] = {
+  {"host", "www.example.com"}, {"cache-control", "no-cache"}
+};
+static const header request_2_table[] = {
+  {"cache-control", "no-cache"}, {":authority", "www.example.com"}
+};
+
+static const header request_3_headers[] = {
+  {"host", "www.example.com"}, {"custom-key", "custom-value"}
+};
+static const header request_3_table[] = {
+  {"custom-key", "custom-value"}, {"cache-control", "no-cache"},
+  {":authority", "www.example.com"}
+};
+
+void test_requests(const char *section, const char *blocks[3]) {
+  crest_hpack_table *table = crest_hpack_create();
+  crest_connection *connection;
+  const char *name = section;
+
+  connection = decode(name, table, blocks[0]);
+  check_request(name, connection, "/");
+  check_headers(name, connection, request_1_headers, 1);
+  check_table(name, table, request_1_table, 1, 57);
+  crest_free_connection(connection);
+
+  connection = decode(name, table, blocks[1]);
+  check_request(name, connection, "/");
+  check_headers(name, connection, request_2_headers, 2);
+  check_table(name, table, request_2_table, 2, 110);
+  crest_free_connection(connection);
+
+  connection = decode(name, table, blocks[2]);
+  check_request(name, connection, "/index.html");
+  check_headers(name, connection, request_3_headers, 2);
+  check_table(name, table, request_3_table, 3, 164);
+  crest_free_connection(connection);
+
+  crest_hpack_destroy(table);
+}
+
+
+/*------------------------------------------------------------*/
+/* response examples with huffman coding (C.6)                */
+/*------------------------------------------------------------*/
+// :status isn't a request pseudo header, so each block is decoded
+// as a malformed request, but the remaining headers are still
+// stored and the dynamic table is still updated
+static const header response_1_headers[] = {
+  {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+  {"location", "https://www.example.com"}
+};
+static const header response_1_table[] = {
+  {"location", "https://www.example.com"},
+  {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+  {"cache-control", "private"}, {":status", "302"}
+};
+
+static const header response_2_table[] = {
+  {":status", "307"}, {"location", "https://www.example.com"},
+  {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+  {"cache-control", "private"}
+};
+
+static const header response_3_headers[] = {
+  {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+  {"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+  {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}
+};
+static const header response_3_table[] = {
+  {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"},
+  {"content-encoding", "gzip"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"}
+};
+
+void test_responses(void) {
+  crest_hpack_table *table = crest_hpack_create();
+  crest_connection *connection;
+  const char *name = "C.6";
+
+  // the examples assume a 256 byte table, so the first block
+  // starts with a dynamic table size update (3fe101)
+  connection = decode(name, table,
+    "3fe101 4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6"
+    "2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3");
+  check(connection->response_status == 400, "status %d", connection->response_status);
+  check_headers(name, connection, response_1_headers, 3);
+  check_table(name, table, response_1_table, 4, 222);
+  crest_free_connection(connection);
+
+  connection = decode(name, table, "4883 640e ff c1 c0 bf");
+  check(connection->response_status == 400, "status %d", connection->response_status);
+  check_headers(name, connection, response_1_headers, 3);
+  check_table(name, table, response_2_table, 4, 222);
+  crest_free_connection(connection);
+
+  connection = decode(name, table,
+    "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7"
+    "821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed"
+    "4ee5 b106 3d50 07");
+  check(connection->response_status == 400, "status %d", connection->response_status);
+  check_headers(name, connection, response_3_headers, 5);
+  check_table(name, table, response_3_table, 3, 215);
+  crest_free_connection(connection);
+
+  crest_hpack_destroy(table);
+}
+
+
+/*------------------------------------------------------------*/
+/* huffman errors                                             */
+/*------------------------------------------------------------*/
+// each block is a literal header "x" without indexing, with a
+// huffman coded value. "a" is coded as 00011, so 1f is "a" padded
+// with three 1 bits. "&" is coded as 11111000, needing no padding
+void test_huffman(void) {
+  crest_hpack_table *table = crest_hpack_create();
+  const char *name = "huffman";
+  crest_connection *connection = decode(name, table, "00 01 78 81 1f");
+  check_headers(name, connection, (const header[]) {{"x", "a"}}, 1);
+  crest_free_connection(connection);
+  crest_hpack_destroy(table);
+
+  // padding must be all 1 bits, and shorter than a byte
+  check_invalid("huffman padding with 0 bits", "00 01 78 81 18");
+  check_invalid("huffman padding of 8 bits", "00 01 78 82 f8 ff");
+  check_invalid("huffman padding of 11 bits", "00 01 78 82 1f ff");
+
+  // 30 1 bits is EOS, which may not appear in the coded string
+  check_invalid("huffman EOS", "00 01 78 84 ff ff ff ff");
+  check_invalid("huffman EOS after a", "00 01 78 85 1f ff ff ff ff");
+}
+
+
+int main(int argc, char **argv) {
+  test_requests("C.3", (const char *[]) {
+    "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+    "8286 84be 5808 6e6f 2d63 6163 6865",
+    "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65"
+  });
+
+  test_requests("C.4", (const char *[]) {
+    "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+    "8286 84be 5886 a8eb 1064 9cbf",
+    "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf"
+  });
+
+  test_responses();
+  test_huffman();
+
+  if(failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
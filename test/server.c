@@ -1,19 +1,21 @@
-#include <stdio.h>
+#include <string.h>
 #include "crest.h"
 
-void route_1(crest_connection *connection) {
-  printf("Route 1\n");
-}
-
-void route_2(crest_connection *connection) {
-  printf("Route 2\n");
-}
-
-void route_3(crest_connection *connection) {
-  printf("Route 3\n");
-}
-
-int main(void) {
-  crest_start_server(8080);
+// usage: test_server [-log access_log_path] [route_table_path]
+// without a route table the routes linked into the binary are
+// used, otherwise routes are loaded (and reloaded) from a shared
+// route table, e.g: bin/test_server_dynamic bin/test_routes.so
+int main(int argc, char **argv) {
+  for(int i = 1; i < argc; i++) {
+    if((strcmp(argv[i], "-log") == 0) && (i + 1 < argc)) {
+      if(crest_open_log(argv[++i]) != CREST_LOG_OK)
+        return 1;
+    } else if(crest_load_routes(argv[i]) != CREST_LOAD_OK) {
+      return 1;
+    }
+  }
+  
+  if(crest_start_server(8080) != CREST_SERVER_OK)
+    return 1;
   return 0;
 }